@@ -3,6 +3,9 @@
 # Helpers for building analyzers. This is can be included from analyzer packages.
 #
 # Needs SPICYZ to point to the "spicyz" binary in either CMake or environment.
+# If SPICYZ_JOBS is set, spicyz runs that many C++ compiler jobs in parallel.
+# If CMAKE_CXX_COMPILER_LAUNCHER is set (e.g., to ccache), spicyz uses it for
+# compiling generated C++ code as well.
 
 include(GNUInstallDirs)
 
@@ -16,11 +19,30 @@ include(GNUInstallDirs)
 #         [PACKAGE_NAME <package_name>]
 #         [SCRIPTS <additional script files to install>...]
 #         [CXX_LINK <libraries to link>...]
+#         [PGO_INSTRUMENT]
+#         [PGO_PROFILE <profile data>]
+#         [CPU_VARIANTS <x86-64 levels>...]
+#         [BUNDLE <bundle_name>]
 #     )
+#
+# BUNDLE does not build the analyzer by itself, but adds its sources to the
+# given bundle; see spicy_add_analyzer_bundle(). PGO_INSTRUMENT, PGO_PROFILE,
+# and CPU_VARIANTS then need to be passed to the bundle instead.
+#
+# CPU_VARIANTS builds additional versions of the analyzer for the given
+# x86-64 microarchitecture levels (e.g., "x86-64-v3"), installed next to the
+# baseline version. At load time, the plugin picks the best one that the
+# CPU supports.
+#
+# PGO_INSTRUMENT builds an analyzer that records execution profiles into
+# "pgo-<analyzer_name>" inside the current binary directory while Zeek runs
+# it. PGO_PROFILE then optimizes the analyzer based on such profiles. For
+# Clang, these need to be merged with "llvm-profdata merge" first; GCC
+# takes the directory as is.
 function (spicy_add_analyzer)
-    set(options)
-    set(oneValueArgs NAME PACKAGE_NAME)
-    set(multiValueArgs SOURCES SCRIPTS CXX_LINK)
+    set(options PGO_INSTRUMENT)
+    set(oneValueArgs NAME PACKAGE_NAME PGO_PROFILE BUNDLE)
+    set(multiValueArgs SOURCES SCRIPTS CXX_LINK CPU_VARIANTS)
 
     cmake_parse_arguments(PARSE_ARGV 0 SPICY_ANALYZER "${options}" "${oneValueArgs}"
                           "${multiValueArgs}")
@@ -45,40 +67,145 @@ function (spicy_add_analyzer)
     string(TOLOWER "${SPICY_ANALYZER_NAME}" NAME_LOWER)
     set(OUTPUT "${SPICY_MODULE_OUTPUT_DIR_BUILD}/${NAME_LOWER}.hlto")
 
+    if (SPICY_SCRIPTS_OUTPUT_DIR_INSTALL AND DEFINED SPICY_ANALYZER_SCRIPTS)
+        if (NOT DEFINED SPICY_ANALYZER_PACKAGE_NAME)
+            message(FATAL_ERROR "SCRIPTS argument requires PACKAGE_NAME")
+        endif ()
+        install(
+            FILES ${SPICY_ANALYZER_SCRIPTS}
+            DESTINATION
+                "${SPICY_SCRIPTS_OUTPUT_DIR_INSTALL}/${SPICY_ANALYZER_PACKAGE_NAME}/${NAME_LOWER}")
+    endif ()
+
+    # A bundle's own target isn't an analyzer by itself, its analyzers have
+    # been listed already when they were added to it.
+    if (NOT __spicy_adding_bundle)
+        get_property(tmp GLOBAL PROPERTY __spicy_included_analyzers)
+        list(APPEND tmp "${SPICY_ANALYZER_NAME}")
+        set_property(GLOBAL PROPERTY __spicy_included_analyzers "${tmp}")
+    endif ()
+
+    if (SPICY_ANALYZER_BUNDLE)
+        if (SPICY_ANALYZER_PGO_INSTRUMENT OR SPICY_ANALYZER_PGO_PROFILE OR SPICY_ANALYZER_CPU_VARIANTS)
+            message(
+                FATAL_ERROR
+                    "PGO_INSTRUMENT, PGO_PROFILE, and CPU_VARIANTS cannot be combined with BUNDLE, "
+                    "pass them to spicy_add_analyzer_bundle() instead")
+        endif ()
+
+        foreach (source ${SPICY_ANALYZER_SOURCES})
+            get_filename_component(source "${source}" ABSOLUTE)
+            set_property(GLOBAL APPEND PROPERTY __spicy_bundle_${SPICY_ANALYZER_BUNDLE}_sources
+                                                "${source}")
+        endforeach ()
+
+        # The bundle gets compiled from a different directory, so resolve
+        # files to link like the sources. Linker flags stay as they are.
+        foreach (cxx_link ${SPICY_ANALYZER_CXX_LINK})
+            if (NOT cxx_link MATCHES "^-")
+                get_filename_component(cxx_link "${cxx_link}" ABSOLUTE)
+            endif ()
+
+            set_property(GLOBAL APPEND PROPERTY __spicy_bundle_${SPICY_ANALYZER_BUNDLE}_cxx_link
+                                                "${cxx_link}")
+        endforeach ()
+
+        return()
+    endif ()
+
     # list(TRANSFORM SPICY_ANALYZER_CXX_LINK PREPEND "--cxx-link ")
     foreach (cxx_link ${SPICY_ANALYZER_CXX_LINK})
         list(APPEND CXX_LINK "--cxx-link")
         list(APPEND CXX_LINK ${cxx_link})
     endforeach ()
 
+    set(PGO)
+    set(PGO_PROFILE)
+    if (SPICY_ANALYZER_PGO_INSTRUMENT AND SPICY_ANALYZER_PGO_PROFILE)
+        message(FATAL_ERROR "PGO_INSTRUMENT and PGO_PROFILE cannot be combined")
+    elseif (SPICY_ANALYZER_PGO_INSTRUMENT)
+        list(APPEND PGO "--pgo-generate" "${CMAKE_CURRENT_BINARY_DIR}/pgo-${NAME_LOWER}")
+    elseif (SPICY_ANALYZER_PGO_PROFILE)
+        get_filename_component(PGO_PROFILE "${SPICY_ANALYZER_PGO_PROFILE}" ABSOLUTE)
+        list(APPEND PGO "--pgo-use" "${PGO_PROFILE}")
+    endif ()
+
     add_custom_command(
         OUTPUT ${OUTPUT}
-        DEPENDS ${SPICY_ANALYZER_SOURCES} spicyz
+        DEPENDS ${SPICY_ANALYZER_SOURCES} ${PGO_PROFILE} spicyz
         COMMENT "Compiling ${SPICY_ANALYZER_NAME} analyzer"
         COMMAND mkdir -p ${SPICY_MODULE_OUTPUT_DIR_BUILD}
-        COMMAND spicyz -o ${OUTPUT} ${SPICYZ_FLAGS} ${SPICY_ANALYZER_SOURCES} ${CXX_LINK}
+        COMMAND ${SPICYZ_ENV} spicyz -o ${OUTPUT} ${SPICYZ_FLAGS} ${PGO} ${SPICY_ANALYZER_SOURCES}
+                ${CXX_LINK}
         WORKING_DIRECTORY ${CMAKE_CURRENT_SOURCE_DIR})
 
-    add_custom_target(${SPICY_ANALYZER_NAME} ALL DEPENDS ${OUTPUT}
+    set(OUTPUTS ${OUTPUT})
+
+    foreach (level ${SPICY_ANALYZER_CPU_VARIANTS})
+        # The plugin only ever looks for these levels at load time.
+        if (NOT level MATCHES "^x86-64-v[234]$")
+            message(FATAL_ERROR "unsupported CPU_VARIANTS level '${level}', "
+                                "must be one of x86-64-v2, x86-64-v3, x86-64-v4")
+        endif ()
+
+        add_custom_command(
+            OUTPUT ${OUTPUT}.${level}
+            DEPENDS ${SPICY_ANALYZER_SOURCES} ${PGO_PROFILE} spicyz
+            COMMENT "Compiling ${SPICY_ANALYZER_NAME} analyzer for ${level}"
+            COMMAND mkdir -p ${SPICY_MODULE_OUTPUT_DIR_BUILD}
+            COMMAND ${SPICYZ_ENV} spicyz -o ${OUTPUT}.${level} --cpu-level ${level} ${SPICYZ_FLAGS} ${PGO}
+                    ${SPICY_ANALYZER_SOURCES} ${CXX_LINK}
+            WORKING_DIRECTORY ${CMAKE_CURRENT_SOURCE_DIR})
+
+        list(APPEND OUTPUTS ${OUTPUT}.${level})
+    endforeach ()
+
+    add_custom_target(${SPICY_ANALYZER_NAME} ALL DEPENDS ${OUTPUTS}
                       COMMENT "Preparing dependencies of ${SPICY_ANALYZER_NAME}")
 
     if (SPICY_MODULE_OUTPUT_DIR_INSTALL)
-        install(FILES ${OUTPUT} DESTINATION "${SPICY_MODULE_OUTPUT_DIR_INSTALL}")
+        install(FILES ${OUTPUTS} DESTINATION "${SPICY_MODULE_OUTPUT_DIR_INSTALL}")
     endif ()
+endfunction ()
 
-    if (SPICY_SCRIPTS_OUTPUT_DIR_INSTALL AND DEFINED SPICY_ANALYZER_SCRIPTS)
-        if (NOT DEFINED SPICY_ANALYZER_PACKAGE_NAME)
-            message(FATAL_ERROR "SCRIPTS argument requires PACKAGE_NAME")
-        endif ()
-        install(
-            FILES ${SPICY_ANALYZER_SCRIPTS}
-            DESTINATION
-                "${SPICY_SCRIPTS_OUTPUT_DIR_INSTALL}/${SPICY_ANALYZER_PACKAGE_NAME}/${NAME_LOWER}")
+# Add target to build all analyzers previously added to a bundle into a single
+# HLTO. Compiling them together means that the analyzers share one copy of
+# the runtime support code and one dlopen() at startup, and that the C++
+# compiler sees all of their code at once.
+#
+# All analyzers in a bundle share the same linker scope. Their Spicy
+# modules must therefore have distinct names, just as when passing all
+# their sources to a single spicyz invocation.
+#
+# Usage:
+#
+#     spicy_add_analyzer_bundle(
+#         NAME <bundle_name>
+#         [PGO_INSTRUMENT]
+#         [PGO_PROFILE <profile data>]
+#         [CPU_VARIANTS <x86-64 levels>...]
+#     )
+function (spicy_add_analyzer_bundle)
+    cmake_parse_arguments(PARSE_ARGV 0 SPICY_BUNDLE "" "NAME" "")
+
+    if (NOT DEFINED SPICY_BUNDLE_NAME)
+        message(FATAL_ERROR "NAME is required")
+    endif ()
+
+    get_property(sources GLOBAL PROPERTY __spicy_bundle_${SPICY_BUNDLE_NAME}_sources)
+    get_property(cxx_link GLOBAL PROPERTY __spicy_bundle_${SPICY_BUNDLE_NAME}_cxx_link)
+
+    if (NOT sources)
+        message(FATAL_ERROR "no analyzers added to bundle ${SPICY_BUNDLE_NAME}")
     endif ()
 
-    get_property(tmp GLOBAL PROPERTY __spicy_included_analyzers)
-    list(APPEND tmp "${SPICY_ANALYZER_NAME}")
-    set_property(GLOBAL PROPERTY __spicy_included_analyzers "${tmp}")
+    list(REMOVE_DUPLICATES sources)
+    list(REMOVE_DUPLICATES cxx_link)
+
+    # Seen by spicy_add_analyzer() through CMake's dynamic scoping.
+    set(__spicy_adding_bundle TRUE)
+    spicy_add_analyzer(NAME ${SPICY_BUNDLE_NAME} SOURCES ${sources} CXX_LINK ${cxx_link}
+                       ${SPICY_BUNDLE_UNPARSED_ARGUMENTS})
 endfunction ()
 
 # Flag that analyzer is *not* being built. This is purely informational:
@@ -146,6 +273,20 @@ if (SPICYZ)
         set(SPICYZ_FLAGS "")
     endif ()
 
+    if (SPICYZ_JOBS)
+        list(APPEND SPICYZ_FLAGS "-j" "${SPICYZ_JOBS}")
+    endif ()
+
+    # Let the C++ compiler invocations inside spicyz go through the same
+    # launcher as the rest of the build (e.g., ccache). With that, modules
+    # whose generated code didn't change don't get recompiled.
+    if (CMAKE_CXX_COMPILER_LAUNCHER)
+        set(SPICYZ_ENV "${CMAKE_COMMAND}" -E env
+                       "HILTI_CXX_COMPILER_LAUNCHER=${CMAKE_CXX_COMPILER_LAUNCHER}")
+    else ()
+        set(SPICYZ_ENV "")
+    endif ()
+
     set(SPICY_MODULE_OUTPUT_DIR_BUILD "${PROJECT_BINARY_DIR}/spicy-modules")
 
     execute_process(COMMAND "${SPICYZ}" "--print-module-path" OUTPUT_VARIABLE output
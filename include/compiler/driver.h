@@ -4,6 +4,7 @@
 
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -88,6 +89,23 @@ public:
      */
     const std::vector<EnumInfo>& publicEnumTypes() { return _enums; }
 
+    /**
+     * Enables reporting of unit fields that no event references. If set,
+     * the glue compiler prints a list of such fields to stdout while
+     * generating code.
+     */
+    void setReportUnusedFields(bool enable) { _report_unused_fields = enable; }
+
+    /** Returns true if unused unit fields are to be reported. */
+    bool reportUnusedFields() const { return _report_unused_fields; }
+
+    /**
+     * Returns the fields of each unit type that Spicy code accesses or
+     * defines hooks for, across all modules compiled so far. This is
+     * recorded only if unused fields are to be reported.
+     */
+    const auto& usedFields() const { return _used_fields; }
+
     /** Returs true if we're running out of the plugin's build directory. */
     bool usingBuildDirectory() const { return _using_build_directory; }
 
@@ -154,11 +172,13 @@ protected:
 
     std::map<hilti::ID, UnitInfo> _units;
     std::vector<EnumInfo> _enums;
+    std::map<hilti::ID, std::set<std::string>> _used_fields;
 
     std::unique_ptr<GlueCompiler> _glue;
 
     bool _using_build_directory = false; // true if we're running out of the plugin's build directory
     bool _need_glue = true;              // true if glue code has not yet been generated
+    bool _report_unused_fields = false;  // true if unit fields not used by any event are to be reported
 };
 
 } // namespace spicy::zeek
@@ -45,6 +45,8 @@ struct ProtocolAnalyzer {
     hilti::ID unit_name_orig; /**< The fully-qualified name of the unit type to parse the originator side. */
     hilti::ID unit_name_resp; /**< The fully-qualified name of the unit type to parse the originator side. */
     std::string replaces;     /**< Name of another analyzer this one replaces. */
+    std::vector<std::string> prefilters_orig; /**< Prefixes one of which the originator's input must start with. */
+    std::vector<std::string> prefilters_resp; /**< Prefixes one of which the responder's input must start with. */
 
     // Computed information.
     std::optional<UnitInfo> unit_orig; /**< The type of the unit to parse the originator side. */
@@ -180,6 +182,13 @@ private:
     /** Computes the missing pieces for all `Event` instances.  */
     bool PopulateEvents();
 
+    /**
+     * Prints all fields of units with events that none of the events'
+     * expressions or conditions reference, and that aren't otherwise used
+     * inside their Spicy module. These are candidates for skipping.
+     */
+    void ReportUnusedFields();
+
     /**
      * Create the Spicy hook for an event that triggers a corresponding Zeek
      * event.
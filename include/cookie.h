@@ -84,24 +84,36 @@ private:
     uint64_t _id_counter = 0;      // counter incremented for each file added to this stack
 };
 
-/** State on the current protocol analyzer. */
+/**
+ * State on the current protocol analyzer. There's one instance per side of
+ * each connection, so this is kept small: anything only some connections
+ * need gets created on first use.
+ */
 struct ProtocolAnalyzer {
     ::zeek::analyzer::Analyzer* analyzer = nullptr; /**< current analyzer */
-    bool is_orig = false;                           /**< direction of the connection */
     uint64_t num_packets = 0;                       /**< number of packets seen so far */
-    FileStateStack fstate_orig;                     /**< file analysis state for originator side */
-    FileStateStack fstate_resp;                     /**< file analysis state for responder side */
-    std::shared_ptr<::zeek::packet_analysis::TCP::TCPSessionAdapter>
-        fake_tcp; /**< fake TPC analyzer created internally */
+    uint64_t buffered = 0;                          /**< bytes passed into parsing without progress */
+    std::unique_ptr<FileStateStack> fstate;         /**< file analysis state for this side, created on first use */
+    std::unique_ptr<::zeek::packet_analysis::TCP::TCPSessionAdapter>
+        fake_tcp;         /**< fake TPC analyzer created internally */
+    bool is_orig = false; /**< direction of the connection */
 };
 
 /** State on the current file analyzer. */
 struct FileAnalyzer {
     ::zeek::file_analysis::Analyzer* analyzer = nullptr; /**< current analyzer */
     uint64_t depth = 0;    /**< recursive depth of file analysis (Spicy-side file analysis only) */
-    FileStateStack fstate; /**< file analysis state for nested files */
+    uint64_t buffered = 0; /**< bytes passed into parsing without progress */
+    std::unique_ptr<FileStateStack> fstate; /**< file analysis state for nested files, created on first use */
 };
 
+#if defined(__LP64__)
+// Guard against the cookies growing back unnoticed, as they exist per
+// connection side and per file. The bounds hold for LP64 only.
+static_assert(sizeof(ProtocolAnalyzer) <= 48, "protocol analyzer cookie has grown");
+static_assert(sizeof(FileAnalyzer) <= 32, "file analyzer cookie has grown");
+#endif
+
 /** State on the current file analyzer. */
 struct PacketAnalyzer {
     ::zeek::packet_analysis::Analyzer* analyzer = nullptr; /**< current analyzer */
@@ -5,6 +5,8 @@
 #include <compiler/driver.h>
 
 #include <memory>
+#include <optional>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -33,6 +35,10 @@ public:
     // Called from plugin::Zeek_Spicy::Plugin, with same semantics.
     void addLibraryPaths(const std::string& dirs);
 
+    // If compilation went through the JIT cache, returns the path of the
+    // resulting HLTO, which the caller needs to load.
+    const std::optional<hilti::rt::filesystem::path>& cachedModule() const { return _cached_module; }
+
 protected:
     /** Overridden from Spicy driver class. */
     void hookAddInput(const hilti::rt::filesystem::path& path) override;
@@ -43,12 +49,23 @@ protected:
     /** Overridden from Spicy driver class. */
     void hookNewEnumType(const spicy::zeek::EnumInfo& e) override;
 
+    /** Overridden from Spicy driver class. */
+    void hookNewASTPreCompilation(std::shared_ptr<hilti::Unit> unit) override;
+
 private:
     friend class Plugin;
     void _initialize();
+    std::string _cacheKey() const;
+    bool _isCacheEntryCurrent(const hilti::rt::filesystem::path& module,
+                              const hilti::rt::filesystem::path& deps) const;
+    void _saveCacheDependencies(const hilti::rt::filesystem::path& deps) const;
 
     bool _initialized = false;
     std::vector<hilti::rt::filesystem::path> _import_paths;
+    std::vector<hilti::rt::filesystem::path> _inputs;          // all files loaded, in order
+    hilti::rt::filesystem::path _cache_dir;                     // JIT cache directory, if enabled
+    std::optional<hilti::rt::filesystem::path> _cached_module; // HLTO from JIT cache to load
+    std::set<hilti::rt::filesystem::path> _resolved_modules;   // all modules that compilation has parsed
 };
 
 } // namespace plugin::Zeek_Spicy
@@ -12,6 +12,7 @@
 #include <spicy/rt/parser.h>
 
 #include <zeek-spicy/cookie.h>
+#include <zeek-spicy/pending-input-budget.h>
 #include <zeek-spicy/zeek-compat.h>
 
 namespace spicy::zeek::rt {
@@ -45,11 +46,14 @@ private:
 };
 
 /** A Spicy file analyzer. */
-class FileAnalyzer : public ::zeek::file_analysis::Analyzer {
+class FileAnalyzer : public ::zeek::file_analysis::Analyzer, public BudgetedAnalyzer {
 public:
     FileAnalyzer(::zeek::RecordValPtr arg_args, ::zeek::file_analysis::File* arg_file);
     virtual ~FileAnalyzer();
 
+    // Overridden from BudgetedAnalyzer.
+    void evictFromBudget() override;
+
     static ::zeek::file_analysis::Analyzer* InstantiateAnalyzer(::zeek::RecordValPtr args,
                                                                 ::zeek::file_analysis::File* file);
 
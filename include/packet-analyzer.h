@@ -16,11 +16,18 @@
 
 #include <zeek-spicy/autogen/config.h>
 #include <zeek-spicy/cookie.h>
+#include <zeek-spicy/statistics.h>
 #include <zeek-spicy/zeek-compat.h>
 
 namespace spicy::zeek::rt {
 
-/** Parsing state for a packet. */
+/**
+ * Parsing state for a packet.
+ *
+ * Even though all of a packet's data is available up front, Spicy still
+ * executes the parsing inside a fiber. Setup cost remains low as long as
+ * the HILTI runtime can reuse cached fibers (see `Spicy::fiber_cache_size`).
+ */
 class PacketState : public spicy::rt::driver::ParsingState {
 public:
     /**
@@ -68,6 +75,8 @@ protected:
 
 private:
     PacketState _state;
+    const spicy::rt::Parser* _parser = nullptr; // parser bound on first packet
+    AnalyzerStatistics* _stats = nullptr;       // statistics bound on first packet
 };
 
 } // namespace spicy::zeek::rt
@@ -0,0 +1,185 @@
+// Copyright (c) 2020-2021 by the Zeek Project. See LICENSE for details.
+
+/**
+ * Process-wide budget for input that Spicy analyzers have passed into
+ * parsing without the parser calling back into Zeek.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace spicy::zeek::rt {
+
+class PendingInputBudget;
+
+/**
+ * Base class for analyzers whose pending input counts against the global
+ * budget. This is the input counted by `cookie::ProtocolAnalyzer::buffered`
+ * and `cookie::FileAnalyzer::buffered`, not the memory that units, streams,
+ * and fibers actually retain, which the runtime doesn't expose. While an
+ * analyzer has input pending, it's linked into the budget's list of
+ * analyzers ordered by recent activity.
+ */
+class BudgetedAnalyzer {
+public:
+    BudgetedAnalyzer() = default;
+    virtual ~BudgetedAnalyzer();
+
+    BudgetedAnalyzer(const BudgetedAnalyzer&) = delete;
+    BudgetedAnalyzer(BudgetedAnalyzer&&) = delete;
+    BudgetedAnalyzer& operator=(const BudgetedAnalyzer&) = delete;
+    BudgetedAnalyzer& operator=(BudgetedAnalyzer&&) = delete;
+
+    /**
+     * Stops all further parsing and releases the analyzer's pending input.
+     * Called by the budget when it evicts the analyzer.
+     */
+    virtual void evictFromBudget() = 0;
+
+    /**
+     * Helper marking an analyzer as currently parsing for the duration of
+     * its life time. Active analyzers are never evicted, which protects
+     * analyzers that nested analysis is running on top of.
+     */
+    class Active {
+    public:
+        Active(BudgetedAnalyzer* analyzer) : _analyzer(analyzer), _was_active(analyzer->_active) {
+            _analyzer->_active = true;
+        }
+
+        ~Active() { _analyzer->_active = _was_active; }
+
+        Active(const Active&) = delete;
+        Active(Active&&) = delete;
+        Active& operator=(const Active&) = delete;
+        Active& operator=(Active&&) = delete;
+
+    private:
+        BudgetedAnalyzer* _analyzer;
+        bool _was_active;
+    };
+
+private:
+    friend class PendingInputBudget;
+
+    PendingInputBudget* _budget = nullptr;    // budget the analyzer is linked into, if any
+    BudgetedAnalyzer* _prev = nullptr;  // more recently active neighbor
+    BudgetedAnalyzer* _next = nullptr;  // less recently active neighbor
+    uint64_t _charged = 0;              // bytes currently charged against the budget
+    bool _active = false;               // true while parsing
+};
+
+/**
+ * Tracks input pending across all Spicy analyzers, and evicts the least
+ * recently active analyzers when a limit is exceeded. The list of analyzers
+ * is intrusive, so updates don't allocate.
+ */
+class PendingInputBudget {
+public:
+    PendingInputBudget() = default;
+    ~PendingInputBudget() {
+        while ( _head )
+            remove(_head);
+    }
+
+    PendingInputBudget(const PendingInputBudget&) = delete;
+    PendingInputBudget(PendingInputBudget&&) = delete;
+    PendingInputBudget& operator=(const PendingInputBudget&) = delete;
+    PendingInputBudget& operator=(PendingInputBudget&&) = delete;
+
+    /** Returns the number of bytes currently charged across all analyzers. */
+    uint64_t total() const { return _total; }
+
+    /**
+     * Records how many bytes an analyzer currently holds, and marks it as
+     * the most recently active one. An analyzer holding no bytes is removed
+     * from the budget.
+     *
+     * @param analyzer analyzer to update
+     * @param bytes number of bytes the analyzer currently holds
+     */
+    void charge(BudgetedAnalyzer* analyzer, uint64_t bytes) {
+        remove(analyzer);
+
+        if ( ! bytes )
+            return;
+
+        analyzer->_budget = this;
+        analyzer->_charged = bytes;
+        analyzer->_next = _head;
+
+        if ( _head )
+            _head->_prev = analyzer;
+        else
+            _tail = analyzer;
+
+        _head = analyzer;
+        _total += bytes;
+    }
+
+    /**
+     * Removes an analyzer from the budget. No-op if it isn't part of it.
+     *
+     * @param analyzer analyzer to remove
+     */
+    void remove(BudgetedAnalyzer* analyzer) {
+        if ( analyzer->_budget != this )
+            return;
+
+        if ( analyzer->_prev )
+            analyzer->_prev->_next = analyzer->_next;
+        else
+            _head = analyzer->_next;
+
+        if ( analyzer->_next )
+            analyzer->_next->_prev = analyzer->_prev;
+        else
+            _tail = analyzer->_prev;
+
+        _total -= analyzer->_charged;
+
+        analyzer->_budget = nullptr;
+        analyzer->_prev = nullptr;
+        analyzer->_next = nullptr;
+        analyzer->_charged = 0;
+    }
+
+    /**
+     * Evicts the least recently active analyzers until the total is back
+     * within a limit. Analyzers that are currently parsing are skipped.
+     *
+     * @param limit maximum number of bytes to retain
+     * @return number of analyzers evicted
+     */
+    uint64_t enforce(uint64_t limit) {
+        uint64_t evicted = 0;
+        auto* analyzer = _tail;
+
+        while ( analyzer && _total > limit ) {
+            auto* prev = analyzer->_prev;
+
+            if ( ! analyzer->_active ) {
+                remove(analyzer);
+                analyzer->evictFromBudget();
+                ++evicted;
+            }
+
+            analyzer = prev;
+        }
+
+        return evicted;
+    }
+
+private:
+    BudgetedAnalyzer* _head = nullptr; // most recently active analyzer
+    BudgetedAnalyzer* _tail = nullptr; // least recently active analyzer
+    uint64_t _total = 0;               // sum of bytes charged across all analyzers
+};
+
+inline BudgetedAnalyzer::~BudgetedAnalyzer() {
+    if ( _budget )
+        _budget->remove(this);
+}
+
+} // namespace spicy::zeek::rt
@@ -7,11 +7,15 @@
 #include <string>
 #include <tuple>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <hilti/rt/library.h>
+#include <hilti/rt/types/bytes.h>
 #include <hilti/rt/types/port.h>
 
+#include <zeek-spicy/pending-input-budget.h>
+#include <zeek-spicy/statistics.h>
 #include <zeek-spicy/zeek-compat.h>
 
 #ifdef ZEEK_SPICY_PLUGIN_USE_JIT
@@ -48,11 +52,17 @@ public:
      * unit's parser with
      * @param replaces optional name of existing Zeek analyzer that this one replaces; the Zeek analyzer will
      * automatically be disabled
+     * @param prefilters_orig byte sequences one of which the originator's input must start with; empty for no
+     * restriction
+     * @param prefilters_resp byte sequences one of which the responder's input must start with; empty for no
+     * restriction
      * @param linker_scope scope of current HLTO file, which will restrict visibility of the registration
      */
     void registerProtocolAnalyzer(const std::string& name, hilti::rt::Protocol proto,
                                   const hilti::rt::Vector<hilti::rt::Port>& ports, const std::string& parser_orig,
                                   const std::string& parser_resp, const std::string& replaces,
+                                  const hilti::rt::Vector<hilti::rt::Bytes>& prefilters_orig,
+                                  const hilti::rt::Vector<hilti::rt::Bytes>& prefilters_resp,
                                   const std::string& linker_scope);
 
     /**
@@ -114,6 +124,30 @@ public:
      */
     const spicy::rt::Parser* parserForProtocolAnalyzer(const spicy::zeek::compat::AnalyzerTag& tag, bool is_orig);
 
+    /**
+     * Runtime method to retrieve the prefilters for a given Zeek protocol analyzer tag.
+     *
+     * @param analyzer requested protocol analyzer
+     * @param is_orig true if requesting the prefilters for a sessions' originator side, false for the responder
+     * @return byte sequences one of which the side's input must start with; empty if there's no restriction
+     */
+    const std::vector<std::string>& prefiltersForProtocolAnalyzer(const spicy::zeek::compat::AnalyzerTag& tag,
+                                                                  bool is_orig) {
+        const auto& info = _protocol_analyzers_by_type[tag.Type()];
+        return is_orig ? info.prefilters_orig : info.prefilters_resp;
+    }
+
+    /**
+     * Runtime method to retrieve the TCP coalescing threshold for a given
+     * Zeek protocol analyzer tag.
+     *
+     * @param tag requested protocol analyzer
+     * @return number of bytes to gather before passing input into parsing; zero if coalescing is disabled
+     */
+    uint64_t coalesceBytesForProtocolAnalyzer(const spicy::zeek::compat::AnalyzerTag& tag) {
+        return _protocol_analyzers_by_type[tag.Type()].coalesce_bytes;
+    }
+
     /**
      * Runtime method to retrieve the Spicy parser for a given Zeek file analyzer tag.
      *
@@ -132,6 +166,65 @@ public:
      */
     const spicy::rt::Parser* parserForPacketAnalyzer(const spicy::zeek::compat::PacketAnalysisTag& tag);
 
+    /**
+     * Runtime method to retrieve the statistics for a given Zeek protocol analyzer tag.
+     *
+     * @param tag protocol analyzer to retrieve statistics for
+     * @return reference to the analyzer's statistics, which may be updated by the caller
+     */
+    spicy::zeek::rt::AnalyzerStatistics& statisticsForProtocolAnalyzer(const spicy::zeek::compat::AnalyzerTag& tag) {
+        return _protocol_analyzers_by_type[tag.Type()].stats;
+    }
+
+    /**
+     * Runtime method to retrieve the statistics for a given Zeek file analyzer tag.
+     *
+     * @param tag file analyzer to retrieve statistics for
+     * @return reference to the analyzer's statistics, which may be updated by the caller
+     */
+    spicy::zeek::rt::AnalyzerStatistics& statisticsForFileAnalyzer(const spicy::zeek::compat::FileAnalysisTag& tag) {
+        return _file_analyzers_by_type[tag.Type()].stats;
+    }
+
+    /**
+     * Runtime method to retrieve the statistics for a given Zeek packet analyzer tag.
+     *
+     * @param tag packet analyzer to retrieve statistics for
+     * @return reference to the analyzer's statistics, which may be updated by the caller
+     */
+    spicy::zeek::rt::AnalyzerStatistics& statisticsForPacketAnalyzer(
+        const spicy::zeek::compat::PacketAnalysisTag& tag) {
+        return _packet_analyzers_by_type[tag.Type()].stats;
+    }
+
+    /**
+     * Returns the budget that all Spicy analyzers' pending input counts
+     * against.
+     */
+    spicy::zeek::rt::PendingInputBudget& pendingInputBudget() { return _pending_input_budget; }
+
+    /**
+     * Returns the statistics of all Spicy analyzers as a Zeek table of type
+     * `Spicy::AnalyzerStatsTable`, indexed by analyzer name.
+     */
+    ::zeek::TableValPtr statistics();
+
+    /**
+     * Returns current resource usage of the HILTI runtime as a Zeek record
+     * of type `Spicy::ResourceUsage`.
+     */
+    ::zeek::RecordValPtr resourceUsage();
+
+    /**
+     * Returns the input that the Spicy protocol analyzers of a connection
+     * have currently pending without the parser calling back into Zeek, as
+     * a Zeek record of type `Spicy::BufferedBytes`.
+     *
+     * @param cid `conn_id` value identifying the connection
+     * @return record summing up all of the connection's Spicy analyzers; zeros if the connection isn't known
+     */
+    ::zeek::RecordValPtr bufferedBytes(::zeek::Val* cid);
+
     /**
      * Runtime method to retrieve the analyzer tag that should be passed to
      * script-land when talking about a protocol analyzer. This is normally
@@ -250,6 +343,10 @@ private:
     // Recursively search pre-compiled *.hlto in colon-separated paths.
     void searchModules(const std::string& paths);
 
+    // Records a directory as searched, returning false if it had been
+    // searched already. The path must be canonical.
+    bool markDirectorySearched(const hilti::rt::filesystem::path& dir);
+
     // Return a Zeek location object for the given file name that will stay valid.
     ::zeek::detail::Location makeLocation(const std::string& fname);
 
@@ -263,6 +360,8 @@ private:
         std::string name_zeekygen;
         hilti::rt::Protocol protocol = hilti::rt::Protocol::Undef;
         hilti::rt::Vector<hilti::rt::Port> ports;
+        std::vector<std::string> prefilters_orig;
+        std::vector<std::string> prefilters_resp;
         spicy::zeek::compat::AnalyzerTag::type_t type;
         std::string linker_scope;
 
@@ -270,6 +369,10 @@ private:
         const spicy::rt::Parser* parser_orig;
         const spicy::rt::Parser* parser_resp;
         spicy::zeek::compat::AnalyzerTag replaces;
+        uint64_t coalesce_bytes = 0;
+
+        // Updated at runtime.
+        spicy::zeek::rt::AnalyzerStatistics stats;
     };
 
     /** Captures a registered file analyzer. */
@@ -286,6 +389,9 @@ private:
         // Filled in during InitPostScript().
         const spicy::rt::Parser* parser;
         spicy::zeek::compat::FileAnalysisTag replaces;
+
+        // Updated at runtime.
+        spicy::zeek::rt::AnalyzerStatistics stats;
     };
 
     /** Captures a registered file analyzer. */
@@ -299,6 +405,9 @@ private:
 
         // Filled in during InitPostScript().
         const spicy::rt::Parser* parser;
+
+        // Updated at runtime.
+        spicy::zeek::rt::AnalyzerStatistics stats;
     };
 
     std::vector<ProtocolAnalyzerInfo> _protocol_analyzers_by_type;
@@ -306,6 +415,8 @@ private:
     std::vector<PacketAnalyzerInfo> _packet_analyzers_by_type;
     std::unordered_map<std::string, hilti::rt::Library> _libraries;
     std::set<std::string> _locations;
+    std::set<std::string> _searched_directories;
+    spicy::zeek::rt::PendingInputBudget _pending_input_budget;
     std::unordered_map<std::string, ::zeek::detail::IDPtr> _events;
 
 #ifdef ZEEK_SPICY_PLUGIN_USE_JIT
@@ -2,6 +2,7 @@
 
 #pragma once
 
+#include <memory>
 #include <optional>
 #include <string>
 #include <utility>
@@ -12,6 +13,7 @@
 #include <spicy/rt/parser.h>
 
 #include <zeek-spicy/cookie.h>
+#include <zeek-spicy/pending-input-budget.h>
 #include <zeek-spicy/zeek-compat.h>
 
 namespace spicy::zeek::rt {
@@ -39,20 +41,50 @@ public:
      */
     void DebugMsg(const std::string& msg) { debug(msg); }
 
+    /** Returns true if the endpoint's input has passed the analyzer's prefilters. */
+    bool prefilterPassed() const { return _prefilter_passed; }
+
+    /** Records that the endpoint's input has passed the analyzer's prefilters. */
+    void setPrefilterPassed() { _prefilter_passed = true; }
+
+    /**
+     * Returns input held back until the analyzer's prefilters can decide on
+     * it. The buffer gets allocated only once needed, so that endpoints
+     * without prefilters don't pay for it.
+     */
+    std::string& prefilterInput() {
+        if ( ! _prefilter_input )
+            _prefilter_input = std::make_unique<std::string>();
+
+        return *_prefilter_input;
+    }
+
+    /** Removes and returns any input held back for the prefilters. */
+    std::string takePrefilterInput() {
+        auto input = _prefilter_input ? std::move(*_prefilter_input) : std::string();
+        _prefilter_input.reset();
+        return input;
+    }
+
 protected:
     // Overridden from driver::ParsingState.
     void debug(const std::string& msg) override;
 
 private:
     Cookie _cookie;
+    bool _prefilter_passed = false;
+    std::unique_ptr<std::string> _prefilter_input;
 };
 
 /** Base clase for Spicy protocol analyzers. */
-class ProtocolAnalyzer {
+class ProtocolAnalyzer : public BudgetedAnalyzer {
 public:
     ProtocolAnalyzer(::zeek::analyzer::Analyzer* analyzer, spicy::rt::driver::ParsingType type);
     virtual ~ProtocolAnalyzer();
 
+    // Overridden from BudgetedAnalyzer.
+    void evictFromBudget() override;
+
     /** Returns the originator-side parsing state. */
     auto& originator() { return _originator; }
 
@@ -75,6 +107,11 @@ protected:
     /**
      * Feeds a chunk of data into one side's parsing.
      *
+     * This must run on Zeek's main thread. Parsing executes the generated
+     * Spicy hooks synchronously, and these create Zeek values and queue
+     * Zeek events, neither of which is thread-safe. The HILTI runtime's
+     * global state (including the fiber cache) is per-process as well.
+     *
      * @param is_orig true to use originator-side endpoint state, false for responder
      * @param len number of bytes valid in *data*
      * @param data pointer to data
@@ -104,10 +141,23 @@ protected:
      */
     void DebugMsg(bool is_orig, const std::string& msg);
 
+protected:
+    // Frees an endpoint's parsing state and skips all of its further input.
+    // Once both sides are done, also frees the shared unit context.
+    void releaseState(EndpointState* endp);
+
 private:
+    // Checks an endpoint's initial input against the analyzer's prefilters.
+    // Returns true if processing should proceed. For stream parsing, the
+    // caller must then parse the input held back in the endpoint instead of
+    // just the current chunk. An endpoint that fails the prefilters gets
+    // skipped; the whole analyzer only once both have.
+    bool checkPrefilters(EndpointState* endp, bool is_orig, int len, const u_char* data);
+
     EndpointState _originator; /**< Originator-side state. */
     EndpointState _responder;  /**< Responder-side state. */
     std::optional<spicy::rt::UnitContext> _context;
+    spicy::rt::driver::ParsingType _type;
 };
 
 /**
@@ -136,6 +186,21 @@ public:
     void PacketWithRST() override;
 
     static ::zeek::analyzer::Analyzer* InstantiateAnalyzer(::zeek::Connection* conn);
+
+private:
+    // Passes data into parsing, and stops TCP processing once both sides are done.
+    void deliver(bool is_orig, int len, const u_char* data);
+
+    // Passes any input coalesced for one side into parsing.
+    void flushCoalesced(bool is_orig);
+
+    // Timer callback passing all coalesced input into parsing.
+    void coalesceTimer(double t);
+
+    uint64_t _coalesce_bytes = 0;  /**< Coalescing threshold, zero if disabled. */
+    std::string _coalesced_orig;   /**< Originator-side input not yet passed into parsing. */
+    std::string _coalesced_resp;   /**< Responder-side input not yet passed into parsing. */
+    bool _coalesce_timer = false;  /**< True if a coalescing timer is pending. */
 };
 
 /**
@@ -11,7 +11,9 @@
 #include <optional>
 #include <string>
 #include <tuple>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <hilti/rt/deferred-expression.h>
 #include <hilti/rt/exception.h>
@@ -83,6 +85,18 @@ public:
  * Registers a Spicy protocol analyzer with its EVT meta information with the
  * plugin's runtime.
  */
+void register_protocol_analyzer(const std::string& name, hilti::rt::Protocol proto,
+                                const hilti::rt::Vector<hilti::rt::Port>& ports, const std::string& parser_orig,
+                                const std::string& parser_resp, const std::string& replaces,
+                                const hilti::rt::Vector<hilti::rt::Bytes>& prefilters_orig,
+                                const hilti::rt::Vector<hilti::rt::Bytes>& prefilters_resp,
+                                const std::string& linker_scope);
+
+/**
+ * Registers a Spicy protocol analyzer without prefilters. This is the entry
+ * point used by code compiled before prefilters existed; we keep it so that
+ * such HLTO files continue to load.
+ */
 void register_protocol_analyzer(const std::string& name, hilti::rt::Protocol proto,
                                 const hilti::rt::Vector<hilti::rt::Port>& ports, const std::string& parser_orig,
                                 const std::string& parser_resp, const std::string& replaces,
@@ -108,8 +122,35 @@ void register_packet_analyzer(const std::string& name, const std::string& parser
 void register_enum_type(const std::string& ns, const std::string& id,
                         const hilti::rt::Vector<std::tuple<std::string, hilti::rt::integer::safe<int64_t>>>& labels);
 
-/** Returns true if an event has at least one handler defined. */
-inline hilti::rt::Bool have_handler(const ::zeek::EventHandlerPtr& handler) { return static_cast<bool>(handler); }
+namespace detail {
+/**
+ * True if input buffered without progress needs tracking, which is the
+ * case when `Spicy::max_buffered_bytes` or `Spicy::max_total_pending_bytes`
+ * is set. Initialized by the plugin once scripts have been parsed.
+ */
+extern bool track_progress;
+} // namespace detail
+
+/**
+ * Records that the current parser has made progress, restarting its
+ * accounting of input buffered without progress (see
+ * `Spicy::max_buffered_bytes`). Runtime functions that let a parser pass on
+ * results to Zeek call this; `have_handler()` does so for event hooks.
+ * No-op if no limit is set.
+ */
+void note_progress();
+
+/**
+ * Returns true if an event has at least one handler defined. As every
+ * generated event hook begins by calling this, it also records progress
+ * for the current parser, whether or not the event has a handler.
+ */
+inline hilti::rt::Bool have_handler(const ::zeek::EventHandlerPtr& handler) {
+    if ( detail::track_progress )
+        note_progress();
+
+    return static_cast<bool>(handler);
+}
 
 /**
  * Creates a new event handler under the given name.
@@ -122,16 +163,43 @@ void install_handler(const std::string& name);
  */
 ::zeek::EventHandlerPtr internal_handler(const std::string& name);
 
-/** Raises a Zeek event, given the handler and arguments. */
-void raise_event(const ::zeek::EventHandlerPtr& handler, const hilti::rt::Vector<::zeek::ValPtr>& args,
-                 const std::string& location);
+/** Zeek types of an event's parameters, as resolved once at startup. */
+using EventArgTypes = std::vector<::zeek::TypePtr>;
+
+/**
+ * Returns the Zeek types of an event's parameters. Generated code calls this
+ * just once per handler at initialization time, and then passes the result
+ * into `event_arg_type()` for each event raised.
+ */
+EventArgTypes event_arg_types(const ::zeek::EventHandlerPtr& handler);
 
 /**
  * Returns the Zeek type of an event's i'th argument. The result's ref count
  * is not increased.
+ *
+ * @param types parameter types of the event, as returned by `event_arg_types()`
+ */
+const ::zeek::TypePtr& event_arg_type(const EventArgTypes& types, const hilti::rt::integer::safe<uint64_t>& idx,
+                                      const std::string& location);
+
+/**
+ * Returns an empty argument list for an event, with capacity for the given
+ * number of arguments already reserved.
+ */
+inline ::zeek::Args event_args(const hilti::rt::integer::safe<uint64_t>& size) {
+    ::zeek::Args args;
+    args.reserve(size);
+    return args;
+}
+
+/** Appends a value to an event's argument list, taking over ownership. */
+void event_arg_push(::zeek::Args& args, ::zeek::ValPtr v, const std::string& location);
+
+/**
+ * Raises a Zeek event, given the handler and arguments. The arguments are
+ * passed on to Zeek's event manager without copying.
  */
-::zeek::TypePtr event_arg_type(const ::zeek::EventHandlerPtr& handler, const hilti::rt::integer::safe<uint64_t>& idx,
-                               const std::string& location);
+void raise_event(const ::zeek::EventHandlerPtr& handler, ::zeek::Args args, const std::string& location);
 
 /**
  * Retrieves the connection ID for the currently processed Zeek connection.
@@ -277,6 +345,13 @@ std::string fuid();
  */
 void terminate_session();
 
+/**
+ * Tells Zeek to skip all further input of the currently active Zeek-side
+ * session. Unlike with `terminate_session()`, the session's state remains
+ * in place.
+ */
+void skip_input();
+
 /**
  * Signals the expected size of a file to Zeek's file analysis.
  *
@@ -337,9 +412,13 @@ template<typename K, typename V>
 ::zeek::ValPtr to_val(const hilti::rt::Map<K, V>& s, ::zeek::TypePtr target, const std::string& location);
 template<typename T>
 ::zeek::ValPtr to_val(const hilti::rt::Set<T>& s, ::zeek::TypePtr target, const std::string& location);
+template<typename K, typename V>
+::zeek::ValPtr to_val(hilti::rt::Map<K, V>&& s, ::zeek::TypePtr target, const std::string& location);
 template<typename T>
 ::zeek::ValPtr to_val(const hilti::rt::Vector<T>& v, ::zeek::TypePtr target, const std::string& location);
 template<typename T>
+::zeek::ValPtr to_val(hilti::rt::Vector<T>&& v, ::zeek::TypePtr target, const std::string& location);
+template<typename T>
 ::zeek::ValPtr to_val(const std::optional<T>& t, ::zeek::TypePtr target, const std::string& location);
 template<typename T>
 ::zeek::ValPtr to_val(const hilti::rt::DeferredExpression<T>& t, ::zeek::TypePtr target, const std::string& location);
@@ -403,7 +482,8 @@ inline ::zeek::ValPtr to_val(const hilti::rt::Bytes& b, ::zeek::TypePtr target,
     if ( target->Tag() != ::zeek::TYPE_STRING )
         throw TypeMismatch("string", target, location);
 
-    return ::zeek::make_intrusive<::zeek::StringVal>(b.str());
+    const auto& data = b.str();
+    return ::zeek::make_intrusive<::zeek::StringVal>(data.size(), data.data());
 }
 
 /**
@@ -517,32 +597,57 @@ inline ::zeek::ValPtr to_val(const hilti::rt::Time& t, ::zeek::TypePtr target, c
     return ::zeek::make_intrusive<::zeek::TimeVal>(t.seconds());
 }
 
+/**
+ * Helper for the vector to_val() versions that checks the target type and
+ * creates a vector value sized for *n* elements.
+ */
+inline ::zeek::VectorValPtr make_vector_val(uint64_t n, const ::zeek::TypePtr& target, const std::string& location) {
+    if ( target->Tag() != ::zeek::TYPE_VECTOR && target->Tag() != ::zeek::TYPE_LIST )
+        throw TypeMismatch("expected vector or list", target, location);
+
+    auto zv = ::zeek::make_intrusive<::zeek::VectorVal>(::zeek::cast_intrusive<::zeek::VectorType>(target));
+    zv->Resize(n);
+    return zv;
+}
+
 /**
  * Converts a Spicy-side vector to a Zeek value. The result is returned with
  * ref count +1.
  */
 template<typename T>
 inline ::zeek::ValPtr to_val(const hilti::rt::Vector<T>& v, ::zeek::TypePtr target, const std::string& location) {
-    if ( target->Tag() != ::zeek::TYPE_VECTOR && target->Tag() != ::zeek::TYPE_LIST )
-        throw TypeMismatch("expected vector or list", target, location);
+    auto zv = make_vector_val(v.size(), target, location);
+    const auto& yield = zv->GetType()->Yield();
 
-    auto vt = ::zeek::cast_intrusive<::zeek::VectorType>(target);
-    auto zv = ::zeek::make_intrusive<::zeek::VectorVal>(vt);
-    for ( auto i : v )
-        zv->Assign(zv->Size(), to_val(i, vt->Yield(), location));
+    unsigned int idx = 0;
+    for ( const auto& i : v )
+        zv->Assign(idx++, to_val(i, yield, location));
 
     return zv;
 }
 
 /**
- * Converts a Spicy-side map to a Zeek value. The result is returned with
- * ref count +1.
+ * Converts a Spicy-side vector that's no longer needed to a Zeek value,
+ * moving its elements into the conversion. The result is returned with ref
+ * count +1.
  */
-template<typename K, typename V>
-inline ::zeek::ValPtr to_val(const hilti::rt::Map<K, V>& m, ::zeek::TypePtr target, const std::string& location) {
-    if constexpr ( hilti::rt::is_tuple<K>::value )
-        throw TypeMismatch("internal error: sets with tuples not yet supported in to_val()");
+template<typename T>
+inline ::zeek::ValPtr to_val(hilti::rt::Vector<T>&& v, ::zeek::TypePtr target, const std::string& location) {
+    auto zv = make_vector_val(v.size(), target, location);
+    const auto& yield = zv->GetType()->Yield();
+
+    unsigned int idx = 0;
+    for ( auto& i : v )
+        zv->Assign(idx++, to_val(std::move(i), yield, location));
 
+    return zv;
+}
+
+/**
+ * Helper for the map to_val() versions that checks the target type and
+ * creates an empty table value.
+ */
+inline ::zeek::TableValPtr make_map_val(const ::zeek::TypePtr& target, const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_TABLE )
         throw TypeMismatch("map", target, location);
 
@@ -553,16 +658,47 @@ inline ::zeek::ValPtr to_val(const hilti::rt::Map<K, V>& m, ::zeek::TypePtr targ
     if ( tt->GetIndexTypes().size() != 1 )
         throw TypeMismatch("map with non-tuple elements", target, location);
 
-    auto zv = ::zeek::make_intrusive<::zeek::TableVal>(tt);
+    // Zeek's tables do not provide a way to reserve capacity up front.
+    return ::zeek::make_intrusive<::zeek::TableVal>(std::move(tt));
+}
 
-    for ( auto i : m ) {
-        auto k = to_val(i.first, tt->GetIndexTypes()[0], location);
-        auto v = to_val(i.second, tt->Yield(), location);
-        zv->Assign(k, v);
-    }
+/**
+ * Converts a Spicy-side map to a Zeek value. The result is returned with
+ * ref count +1.
+ */
+template<typename K, typename V>
+inline ::zeek::ValPtr to_val(const hilti::rt::Map<K, V>& m, ::zeek::TypePtr target, const std::string& location) {
+    if constexpr ( hilti::rt::is_tuple<K>::value )
+        throw TypeMismatch("internal error: sets with tuples not yet supported in to_val()");
+
+    auto zv = make_map_val(target, location);
+    const auto& index_type = zv->GetType<::zeek::TableType>()->GetIndexTypes()[0];
+    const auto& yield = zv->GetType()->Yield();
+
+    for ( const auto& i : m )
+        zv->Assign(to_val(i.first, index_type, location), to_val(i.second, yield, location));
 
     return zv;
-} // namespace spicy::zeek::rt
+}
+
+/**
+ * Converts a Spicy-side map that's no longer needed to a Zeek value, moving
+ * its values into the conversion. The result is returned with ref count +1.
+ */
+template<typename K, typename V>
+inline ::zeek::ValPtr to_val(hilti::rt::Map<K, V>&& m, ::zeek::TypePtr target, const std::string& location) {
+    if constexpr ( hilti::rt::is_tuple<K>::value )
+        throw TypeMismatch("internal error: sets with tuples not yet supported in to_val()");
+
+    auto zv = make_map_val(target, location);
+    const auto& index_type = zv->GetType<::zeek::TableType>()->GetIndexTypes()[0];
+    const auto& yield = zv->GetType()->Yield();
+
+    for ( auto& i : m )
+        zv->Assign(to_val(i.first, index_type, location), to_val(std::move(i.second), yield, location));
+
+    return zv;
+}
 
 /**
  * Converts a Spicy-side set to a Zeek value. The result is returned with
@@ -579,36 +715,84 @@ inline ::zeek::ValPtr to_val(const hilti::rt::Set<T>& s, ::zeek::TypePtr target,
 
     auto zv = ::zeek::make_intrusive<::zeek::TableVal>(tt);
 
-    for ( auto i : s ) {
+    // Set elements are immutable, so there's no version moving them out.
+    for ( const auto& i : s ) {
         if constexpr ( hilti::rt::is_tuple<T>::value )
             throw TypeMismatch("internal error: sets with tuples not yet supported in to_val()");
         else {
             if ( tt->GetIndexTypes().size() != 1 )
                 throw TypeMismatch("set with non-tuple elements", target, location);
 
-            auto idx = to_val(i, tt->GetIndexTypes()[0], location);
-            zv->Assign(idx, nullptr);
+            zv->Assign(to_val(i, tt->GetIndexTypes()[0], location), nullptr);
         }
     }
 
     return zv;
 }
 
+namespace detail {
+
+/**
+ * Precomputed information for converting Spicy-side structs or tuples into
+ * a specific Zeek record type. The to_val() versions for structs and tuples
+ * build this once per pair of Spicy and Zeek type, and then reuse it for
+ * all subsequent conversions.
+ */
+struct RecordConversion {
+    ::zeek::RecordTypePtr rtype;              /**< target record type */
+    std::vector<::zeek::TypePtr> field_types; /**< types of the record's fields, by index */
+    std::vector<bool> may_remain_unset;       /**< true for fields with &optional or &default, by index */
+};
+
+/** Creates the conversion information for a Zeek record type. */
+inline RecordConversion make_record_conversion(::zeek::RecordTypePtr rtype) {
+    RecordConversion rc;
+    rc.field_types.reserve(rtype->NumFields());
+    rc.may_remain_unset.reserve(rtype->NumFields());
+
+    for ( int i = 0; i < rtype->NumFields(); i++ ) {
+        const auto& attrs = rtype->FieldDecl(i)->attrs;
+        rc.field_types.emplace_back(rtype->GetFieldType(i));
+        rc.may_remain_unset.emplace_back(
+            attrs && (attrs->Find(::zeek::detail::ATTR_DEFAULT) || attrs->Find(::zeek::detail::ATTR_OPTIONAL)));
+    }
+
+    rc.rtype = std::move(rtype);
+    return rc;
+}
+
+/**
+ * Cache of conversion information for one Spicy-side type, indexed by the
+ * target record type. Entries keep their record type alive, so the
+ * pointers used as keys remain unique.
+ */
+using RecordConversionCache = std::unordered_map<const ::zeek::Type*, RecordConversion>;
+
+} // namespace detail
+
 /**
  * Converts a Spicy-side tuple to a Zeek record value. The result is returned
  * with ref count +1.
  */
 template<typename T, typename std::enable_if_t<hilti::rt::is_tuple<T>::value>*>
 inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::string& location) {
-    if ( target->Tag() != ::zeek::TYPE_RECORD )
-        throw TypeMismatch("tuple", target, location);
+    static detail::RecordConversionCache cache;
+
+    auto i = cache.find(target.get());
+    if ( i == cache.end() ) {
+        if ( target->Tag() != ::zeek::TYPE_RECORD )
+            throw TypeMismatch("tuple", target, location);
 
-    auto rtype = ::zeek::cast_intrusive<::zeek::RecordType>(target);
+        auto rtype = ::zeek::cast_intrusive<::zeek::RecordType>(target);
 
-    if ( std::tuple_size<T>::value != rtype->NumFields() )
-        throw TypeMismatch("tuple", target, location);
+        if ( std::tuple_size<T>::value != rtype->NumFields() )
+            throw TypeMismatch("tuple", target, location);
 
-    auto rval = ::zeek::make_intrusive<::zeek::RecordVal>(rtype);
+        i = cache.emplace(target.get(), detail::make_record_conversion(std::move(rtype))).first;
+    }
+
+    const auto& rc = i->second;
+    auto rval = ::zeek::make_intrusive<::zeek::RecordVal>(rc.rtype);
     int idx = 0;
     hilti::rt::tuple_for_each(t, [&](const auto& x) {
         ::zeek::ValPtr v = nullptr;
@@ -618,17 +802,13 @@ inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::stri
         }
         else
             // This may return a nullptr in cases where the field is to be left unset.
-            v = to_val(x, rtype->GetFieldType(idx), location);
+            v = to_val(x, rc.field_types[idx], location);
 
         if ( v )
-            rval->Assign(idx, v);
-        else {
-            // Field must be &optional or &default.
-            if ( auto attrs = rtype->FieldDecl(idx)->attrs; ! attrs || ! (attrs->Find(::zeek::detail::ATTR_DEFAULT) ||
-                                                                          attrs->Find(::zeek::detail::ATTR_OPTIONAL)) )
-                throw TypeMismatch(hilti::rt::fmt("missing initialization for field '%s'", rtype->FieldName(idx)),
-                                   location);
-        }
+            rval->Assign(idx, std::move(v));
+        else if ( ! rc.may_remain_unset[idx] )
+            throw TypeMismatch(hilti::rt::fmt("missing initialization for field '%s'", rc.rtype->FieldName(idx)),
+                               location);
 
         idx++;
     });
@@ -642,27 +822,47 @@ inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::stri
  */
 template<typename T, typename std::enable_if_t<std::is_base_of<::hilti::rt::trait::isStruct, T>::value>*>
 inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::string& location) {
-    if ( target->Tag() != ::zeek::TYPE_RECORD )
-        throw TypeMismatch("struct", target, location);
+    static detail::RecordConversionCache cache;
 
-    auto rtype = ::zeek::cast_intrusive<::zeek::RecordType>(target);
+    auto i = cache.find(target.get());
+    if ( i == cache.end() ) {
+        if ( target->Tag() != ::zeek::TYPE_RECORD )
+            throw TypeMismatch("struct", target, location);
 
-    auto rval = ::zeek::make_intrusive<::zeek::RecordVal>(rtype);
-    int idx = 0;
+        auto rtype = ::zeek::cast_intrusive<::zeek::RecordType>(target);
+        auto num_fields = rtype->NumFields();
+        int idx = 0;
 
-    auto num_fields = rtype->NumFields();
+        // Field names are fixed for a given pair of types, so we validate
+        // them just once before caching the conversion information.
+        t.__visit([&](const auto& name, const auto& /* val */) {
+            if ( idx >= num_fields )
+                throw TypeMismatch(hilti::rt::fmt("no matching record field for field '%s'", name), location);
 
-    t.__visit([&](const auto& name, const auto& val) {
-        if ( idx >= num_fields )
-            throw TypeMismatch(hilti::rt::fmt("no matching record field for field '%s'", name), location);
+            std::string field_name = rtype->FieldName(idx);
 
-        auto field = rtype->GetFieldType(idx);
-        std::string field_name = rtype->FieldName(idx);
+            if ( field_name != name )
+                throw TypeMismatch(hilti::rt::fmt("mismatch in field name: expected '%s', found '%s'", name,
+                                                  field_name),
+                                   location);
+
+            idx++;
+        });
 
-        if ( field_name != name )
-            throw TypeMismatch(hilti::rt::fmt("mismatch in field name: expected '%s', found '%s'", name, field_name),
+        // We already check above that all Spicy-side fields are mapped so we
+        // can only hit this if there are uninitialized Zeek-side fields left.
+        if ( idx != num_fields )
+            throw TypeMismatch(hilti::rt::fmt("missing initialization for field '%s'", rtype->FieldName(idx)),
                                location);
 
+        i = cache.emplace(target.get(), detail::make_record_conversion(std::move(rtype))).first;
+    }
+
+    const auto& rc = i->second;
+    auto rval = ::zeek::make_intrusive<::zeek::RecordVal>(rc.rtype);
+    int idx = 0;
+
+    t.__visit([&](const auto& /* name */, const auto& val) {
         ::zeek::ValPtr v = nullptr;
 
         if constexpr ( std::is_same<decltype(val), const hilti::rt::Null&>::value ) {
@@ -670,26 +870,17 @@ inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::stri
         }
         else
             // This may return a nullptr in cases where the field is to be left unset.
-            v = to_val(val, field, location);
+            v = to_val(val, rc.field_types[idx], location);
 
         if ( v )
-            rval->Assign(idx, v);
-        else {
-            // Field must be &optional or &default.
-            if ( auto attrs = rtype->FieldDecl(idx)->attrs; ! attrs || ! (attrs->Find(::zeek::detail::ATTR_DEFAULT) ||
-                                                                          attrs->Find(::zeek::detail::ATTR_OPTIONAL)) )
-                throw TypeMismatch(hilti::rt::fmt("missing initialization for field '%s'", field_name), location);
-        }
+            rval->Assign(idx, std::move(v));
+        else if ( ! rc.may_remain_unset[idx] )
+            throw TypeMismatch(hilti::rt::fmt("missing initialization for field '%s'", rc.rtype->FieldName(idx)),
+                               location);
 
         idx++;
     });
 
-    // We already check above that all Spicy-side fields are mapped so we
-    // can only hit this if there are uninitialized Zeek-side fields left.
-    if ( idx != num_fields )
-        throw TypeMismatch(hilti::rt::fmt("missing initialization for field '%s'", rtype->FieldName(idx + 1)),
-                           location);
-
     return rval;
 }
 
@@ -0,0 +1,79 @@
+// Copyright (c) 2020-2021 by the Zeek Project. See LICENSE for details.
+
+/**
+ * Runtime statistics collected for each Spicy analyzer.
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include <chrono>
+#include <cstdint>
+
+namespace spicy::zeek::rt {
+
+/**
+ * Counters aggregated across all instances of one Spicy analyzer. Times are
+ * inclusive, i.e., they contain any nested analysis triggered while the
+ * analyzer was running (e.g., file analysis fed from a protocol analyzer).
+ */
+struct AnalyzerStatistics {
+    uint64_t bytes = 0;         /**< number of payload bytes delivered, including skipped ones */
+    uint64_t chunks = 0;        /**< number of data chunks passed into parsing */
+    uint64_t parse_errors = 0;  /**< number of parse errors reported as analyzer violations */
+    uint64_t events = 0;        /**< number of Zeek events raised */
+    double wall_time = 0.0;     /**< wall clock time spent in parsing, in seconds */
+    double cpu_time = 0.0;      /**< CPU time spent in parsing by the current thread, in seconds */
+    uint64_t bytes_skipped = 0; /**< number of payload bytes dropped without copying while skipping */
+};
+
+/**
+ * Helper measuring wall clock and CPU time for the duration of its life
+ * time. The measured times are added to the given statistics on
+ * destruction.
+ */
+class StatisticsTimer {
+public:
+    /**
+     * Constructor.
+     *
+     * @param stats statistics to update on destruction; if null, nothing will be measured
+     */
+    StatisticsTimer(AnalyzerStatistics* stats) : _stats(stats) {
+        if ( ! _stats )
+            return;
+
+        _wall_start = std::chrono::steady_clock::now();
+        _cpu_start = cpuTime();
+    }
+
+    ~StatisticsTimer() {
+        if ( ! _stats )
+            return;
+
+        _stats->wall_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - _wall_start).count();
+        _stats->cpu_time += cpuTime() - _cpu_start;
+    }
+
+    StatisticsTimer(const StatisticsTimer&) = delete;
+    StatisticsTimer(StatisticsTimer&&) = delete;
+    StatisticsTimer& operator=(const StatisticsTimer&) = delete;
+    StatisticsTimer& operator=(StatisticsTimer&&) = delete;
+
+private:
+    // Returns the CPU time consumed by the current thread, in seconds.
+    static double cpuTime() {
+        struct timespec ts;
+        if ( clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0 )
+            return 0.0;
+
+        return static_cast<double>(ts.tv_sec) + static_cast<double>(ts.tv_nsec) / 1e9;
+    }
+
+    AnalyzerStatistics* _stats;
+    std::chrono::steady_clock::time_point _wall_start;
+    double _cpu_start = 0.0;
+};
+
+} // namespace spicy::zeek::rt
@@ -172,12 +172,24 @@ inline void SessionMgr_Remove(::zeek::Connection* c) {
     assert(::zeek::session_mgr);
     ::zeek::session_mgr->Remove(c);
 }
+inline void Connection_SetSkip(::zeek::Connection* c) { c->GetSessionAdapter()->SetSkip(true); }
+inline ::zeek::analyzer::Analyzer* Connection_RootAnalyzer(::zeek::Connection* c) { return c->GetSessionAdapter(); }
+inline ::zeek::Connection* SessionMgr_FindConnection(::zeek::Val* v) {
+    assert(::zeek::session_mgr);
+    return ::zeek::session_mgr->FindConnection(v);
+}
 #else
 inline auto Connection_ConnVal(::zeek::Connection* c) { return c->ConnVal(); }
 inline void SessionMgr_Remove(::zeek::Connection* c) {
     assert(::zeek::sessions);
     ::zeek::sessions->Remove(c);
 }
+inline void Connection_SetSkip(::zeek::Connection* c) { c->SetSkip(true); }
+inline ::zeek::analyzer::Analyzer* Connection_RootAnalyzer(::zeek::Connection* c) { return c->GetRootAnalyzer(); }
+inline ::zeek::Connection* SessionMgr_FindConnection(::zeek::Val* v) {
+    assert(::zeek::sessions);
+    return ::zeek::sessions->FindConnection(v);
+}
 #endif
 
 } // namespace spicy::zeek::compat
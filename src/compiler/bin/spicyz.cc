@@ -1,6 +1,7 @@
 // Copyright (c) 2020-2021 by the Zeek Project. See LICENSE for details.
 
 #include <getopt.h>
+#include <stdlib.h>
 
 #include <hilti/base/result.h>
 #include <hilti/base/util.h>
@@ -14,26 +15,35 @@ const ::hilti::logging::DebugStream ZeekPlugin("zeek");
 void ::spicy::zeek::debug::do_log(const std::string& msg) { HILTI_DEBUG(ZeekPlugin, std::string(msg)); }
 
 constexpr int OPT_CXX_LINK = 1000;
+constexpr int OPT_REPORT_UNUSED_FIELDS = 1001;
+constexpr int OPT_PGO_GENERATE = 1002;
+constexpr int OPT_PGO_USE = 1003;
+constexpr int OPT_CPU_LEVEL = 1004;
 
 static struct option long_driver_options[] = {{"abort-on-exceptions", required_argument, nullptr, 'A'},
                                               {"show-backtraces", required_argument, nullptr, 'B'},
                                               {"compiler-debug", required_argument, nullptr, 'D'},
+                                              {"cpu-level", required_argument, nullptr, OPT_CPU_LEVEL},
                                               {"cxx-link", required_argument, nullptr, OPT_CXX_LINK},
                                               {"debug", no_argument, nullptr, 'd'},
                                               {"debug-addl", required_argument, nullptr, 'X'},
                                               {"disable-optimizations", no_argument, nullptr, 'g'},
                                               {"dump-code", no_argument, nullptr, 'C'},
                                               {"help", no_argument, nullptr, 'h'},
+                                              {"jobs", required_argument, nullptr, 'j'},
                                               {"keep-tmps", no_argument, nullptr, 'T'},
                                               {"library-path", required_argument, nullptr, 'L'},
                                               {"optimize", no_argument, nullptr, 'O'},
                                               {"output", required_argument, nullptr, 'o'},
                                               {"output-c++", required_argument, nullptr, 'c'},
+                                              {"pgo-generate", required_argument, nullptr, OPT_PGO_GENERATE},
+                                              {"pgo-use", required_argument, nullptr, OPT_PGO_USE},
                                               {"print-module-path", no_argument, nullptr, 'M'},
                                               {"print-plugin-path", no_argument, nullptr, 'P'},
                                               {"print-prefix-path", no_argument, nullptr, 'p'},
                                               {"print-zeek-config", no_argument, nullptr, 'z'},
                                               {"report-times", required_argument, nullptr, 'R'},
+                                              {"report-unused-fields", no_argument, nullptr, OPT_REPORT_UNUSED_FIELDS},
                                               {"print-scripts-path", no_argument, nullptr, 'S'},
                                               {"skip-validation", no_argument, nullptr, '!'},
                                               {"version", no_argument, nullptr, 'v'},
@@ -46,6 +56,7 @@ static void usage() {
                  "  -c | --output-c++ <prefix>      Output generated C++ code.\n"
                  "  -d | --debug                    Include debug instrumentation into generated code.\n"
                  "  -g | --disable-optimizations    Disable HILTI-side optimizations of the generated code.\n"
+                 "  -j | --jobs <n>                 Number of C++ compiler jobs to run in parallel.\n"
                  "  -o | --output-to <path>         Path for saving output.\n"
                  "  -v | --version                  Print version information.\n"
                  "  -z | --print-zeek-config        Print path to zeek-config.\n"
@@ -64,8 +75,12 @@ static void usage() {
                  "  -S | --print-scripts-path       Print the path to Zeek scripts accompanying Spicy modules.\n"
                  "  -T | --keep-tmps                Do not delete any temporary files created.\n"
                  "       --skip-validation          Don't validate ASTs (for debugging only).\n"
+                 "       --report-unused-fields     Report unit fields that no event uses.\n"
                  "  -X | --debug-addl <addl>        Implies -d and adds selected additional instrumentation."
                  "(comma-separated; see 'help' for list).\n"
+                 "       --cpu-level <level>        Build generated code for x86-64-v2, x86-64-v3, or x86-64-v4.\n"
+                 "       --pgo-generate <dir>       Instrument generated code to record execution profiles into <dir>.\n"
+                 "       --pgo-use <path>           Optimize generated code using previously recorded profiles.\n"
                  "       --cxx-link <lib>           Link specified static archive or shared library during JIT or to "
                  "\n"
                  "Inputs can be *.spicy, *.evt, *.hlt, .cc/.cxx\n"
@@ -74,6 +89,15 @@ static void usage() {
 
 using hilti::Nothing;
 
+// Appends to the flags that the HILTI JIT passes to the C++ compiler.
+static void addCxxFlags(const std::string& flags) {
+    std::string current;
+    if ( auto x = ::getenv("HILTI_CXX_FLAGS") )
+        current = std::string(x) + " ";
+
+    ::setenv("HILTI_CXX_FLAGS", (current + flags).c_str(), 1);
+}
+
 static auto pluginPath() {
     auto exec = hilti::util::currentExecutable();
 
@@ -97,10 +121,10 @@ static auto pluginPath() {
     hilti::rt::cannot_be_reached();
 }
 
-static hilti::Result<Nothing> parseOptions(int argc, char** argv, hilti::driver::Options* driver_options,
-                                           hilti::Options* compiler_options) {
+static hilti::Result<Nothing> parseOptions(int argc, char** argv, spicy::zeek::Driver* driver,
+                                           hilti::driver::Options* driver_options, hilti::Options* compiler_options) {
     while ( true ) {
-        int c = getopt_long(argc, argv, "ABc:CdgX:D:L:Mo:OpPRSTvhz", long_driver_options, nullptr);
+        int c = getopt_long(argc, argv, "ABc:Cdgj:X:D:L:Mo:OpPRSTvhz", long_driver_options, nullptr);
 
         if ( c == -1 )
             break;
@@ -131,6 +155,18 @@ static hilti::Result<Nothing> parseOptions(int argc, char** argv, hilti::driver:
                 break;
             }
 
+            case 'j': {
+                // The HILTI JIT compiles the C++ code for all modules
+                // through a job pool that takes its size from the
+                // environment.
+                auto jobs = std::string(optarg);
+                if ( jobs.empty() || jobs.find_first_not_of("0123456789") != std::string::npos || jobs == "0" )
+                    return hilti::result::Error(hilti::util::fmt("invalid number of jobs '%s'", jobs));
+
+                ::setenv("HILTI_JIT_PARALLELISM", jobs.c_str(), 1);
+                break;
+            }
+
             case 'p': std::cout << spicy::zeek::configuration::InstallPrefix << std::endl; return Nothing();
 
             case 'P': std::cout << pluginPath().native() << std::endl; return Nothing();
@@ -208,6 +244,35 @@ static hilti::Result<Nothing> parseOptions(int argc, char** argv, hilti::driver:
 #endif
                 break;
 
+            case OPT_CPU_LEVEL: {
+                // The plugin only ever looks for these levels at load time.
+                std::string level = optarg;
+                if ( level != "x86-64-v2" && level != "x86-64-v3" && level != "x86-64-v4" )
+                    return hilti::result::Error(
+                        hilti::util::fmt("unsupported CPU level '%s', must be one of x86-64-v2, x86-64-v3, x86-64-v4",
+                                         level));
+
+                addCxxFlags(hilti::util::fmt("-march=%s", level));
+                break;
+            }
+
+            case OPT_PGO_GENERATE: {
+                // The flag needs to reach the link step as well so that the
+                // HLTO pulls in the compiler's profiling runtime.
+                auto flag = hilti::util::fmt("-fprofile-generate=%s", optarg);
+                addCxxFlags(flag);
+#if SPICY_VERSION_NUMBER >= 10600
+                compiler_options->cxx_link.emplace_back(flag);
+#else
+                return hilti::result::Error("option '--pgo-generate' is only supported for Spicy 1.6 or newer");
+#endif
+                break;
+            }
+
+            case OPT_PGO_USE: addCxxFlags(hilti::util::fmt("-fprofile-use=%s", optarg)); break;
+
+            case OPT_REPORT_UNUSED_FIELDS: driver->setReportUnusedFields(true); break;
+
             case 'h': usage(); return Nothing();
 
             case '!': compiler_options->skip_validation = true; break;
@@ -237,7 +302,7 @@ int main(int argc, char** argv) {
 
     auto compiler_options = driver.hiltiOptions();
 
-    if ( auto rc = parseOptions(argc, argv, &driver_options, &compiler_options); ! rc ) {
+    if ( auto rc = parseOptions(argc, argv, &driver, &driver_options, &compiler_options); ! rc ) {
         hilti::logger().error(rc.error().description());
         return 1;
     }
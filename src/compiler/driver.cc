@@ -3,14 +3,19 @@
 #include <getopt.h>
 
 #include <algorithm>
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <hilti/ast/declarations/type.h>
+#include <hilti/ast/expressions/member.h>
 
+#include <spicy/ast/declarations/unit-hook.h>
 #include <spicy/ast/detail/visitor.h>
+#include <spicy/ast/operators/unit.h>
 #include <spicy/ast/types/unit.h>
 #include <spicy/autogen/config.h>
 #include <zeek-spicy/autogen/config.h>
@@ -78,6 +83,47 @@ struct VisitorPostCompilation : public hilti::visitor::PreOrder<void, VisitorPos
     std::vector<UnitInfo> units;
 };
 
+/** Visitor to collect the unit fields that Spicy code accesses, or that have hooks. */
+struct VisitorUsedFields : public hilti::visitor::PreOrder<void, VisitorUsedFields> {
+    void operator()(const spicy::operator_::unit::MemberConst& n) { record(n.op0(), n.op1()); }
+    void operator()(const spicy::operator_::unit::MemberNonConst& n) { record(n.op0(), n.op1()); }
+    void operator()(const spicy::operator_::unit::TryMember& n) { record(n.op0(), n.op1()); }
+    void operator()(const spicy::operator_::unit::HasMember& n) { record(n.op0(), n.op1()); }
+    void operator()(const spicy::operator_::unit::Unset& n) { record(n.op0(), n.op1()); }
+
+    // Hooks defined outside of their unit, potentially in another module.
+    void operator()(const spicy::declaration::UnitHook& n) {
+        auto unit = n.unitType().typeID();
+        fields[unit ? *unit : n.id().namespace_()].insert(n.id().local());
+    }
+
+    // Hooks defined inside their unit, either separately or with the field.
+    void operator()(const hilti::declaration::Type& t) {
+        auto ut = t.type().tryAs<spicy::type::Unit>();
+        if ( ! ut || ! t.type().typeID() )
+            return;
+
+        auto& unit_fields = fields[*t.type().typeID()];
+
+        for ( const auto& h : ut->items<spicy::type::unit::item::UnitHook>() )
+            unit_fields.insert(h.id().str());
+
+        for ( const auto& f : ut->items<spicy::type::unit::item::Field>() ) {
+            if ( f.hooks().size() )
+                unit_fields.insert(f.id().str());
+        }
+    }
+
+    void record(const hilti::Expression& unit, const hilti::Expression& member) {
+        auto id = unit.type().typeID();
+        auto m = member.tryAs<hilti::expression::Member>();
+        if ( id && m )
+            fields[*id].insert(m->id().str());
+    }
+
+    std::map<hilti::ID, std::set<std::string>> fields;
+};
+
 Driver::Driver(const char* argv0, hilti::rt::filesystem::path plugin_path, int zeek_version)
     : spicy::Driver("<Spicy Plugin for Zeek>") {
     spicy::Configuration::extendHiltiConfiguration();
@@ -396,6 +442,15 @@ void Driver::hookNewASTPostCompilation(std::shared_ptr<hilti::Unit> unit) {
         _units[u.id] = std::move(u);
     }
 
+    if ( _report_unused_fields ) {
+        auto v = VisitorUsedFields();
+        for ( auto i : v.walk(unit->module()) )
+            v.dispatch(i);
+
+        for ( auto&& [id, fields] : v.fields )
+            _used_fields[id].insert(fields.begin(), fields.end());
+    }
+
     _glue->addSpicyModule(unit->id(), unit->path());
 }
 
@@ -3,7 +3,10 @@
 #include "compiler/glue-compiler.h"
 
 #include <algorithm>
+#include <fstream>
+#include <iostream>
 #include <limits>
+#include <sstream>
 #include <stdexcept>
 
 #include <hilti/ast/all.h>
@@ -12,6 +15,7 @@
 #include <hilti/base/util.h>
 #include <hilti/compiler/unit.h>
 
+#include <spicy/ast/types/unit-items/field.h>
 #include <spicy/global.h>
 #include <zeek-spicy/autogen/config.h>
 
@@ -138,6 +142,53 @@ static int extract_int(const std::string& chunk, size_t* i) {
     return integer;
 }
 
+// Extracts a double-quoted string of raw bytes, supporting the escape
+// sequences \\, \", \0, \n, \r, \t, and \xHH.
+static std::string extract_bytes(const std::string& chunk, size_t* i) {
+    eat_token(chunk, i, "\"");
+
+    std::string bytes;
+
+    while ( true ) {
+        if ( *i >= chunk.size() )
+            throw ParseError("unterminated string");
+
+        auto c = chunk[(*i)++];
+
+        if ( c == '"' )
+            break;
+
+        if ( c != '\\' ) {
+            bytes += c;
+            continue;
+        }
+
+        if ( *i >= chunk.size() )
+            throw ParseError("unterminated string");
+
+        switch ( c = chunk[(*i)++] ) {
+            case '\\':
+            case '"': bytes += c; break;
+            case '0': bytes += '\0'; break;
+            case 'n': bytes += '\n'; break;
+            case 'r': bytes += '\r'; break;
+            case 't': bytes += '\t'; break;
+            case 'x': {
+                if ( *i + 2 > chunk.size() || ! isxdigit(chunk[*i]) || ! isxdigit(chunk[*i + 1]) )
+                    throw ParseError("invalid \\x escape sequence");
+
+                bytes += static_cast<char>(std::stoi(chunk.substr(*i, 2), nullptr, 16));
+                *i += 2;
+                break;
+            }
+
+            default: throw ParseError(hilti::util::fmt("unknown escape sequence '\\%c'", c));
+        }
+    }
+
+    return bytes;
+}
+
 static std::string extract_expr(const std::string& chunk, size_t* i) {
     eat_spaces(chunk, i);
 
@@ -568,6 +619,33 @@ glue::ProtocolAnalyzer GlueCompiler::parseProtocolAnalyzer(const std::string& ch
             a.ports.insert(a.ports.end(), ports.begin(), ports.end());
         }
 
+        else if ( looking_at(chunk, i, "prefilter") ) {
+            eat_token(chunk, &i, "prefilter");
+
+            if ( looking_at(chunk, i, "originator") ) {
+                eat_token(chunk, &i, "originator");
+                dir = orig;
+            }
+
+            else if ( looking_at(chunk, i, "responder") ) {
+                eat_token(chunk, &i, "responder");
+                dir = resp;
+            }
+
+            else
+                dir = both;
+
+            auto prefix = extract_bytes(chunk, &i);
+            if ( prefix.empty() )
+                throw ParseError("prefilter must not be empty");
+
+            if ( dir == orig || dir == both )
+                a.prefilters_orig.push_back(prefix);
+
+            if ( dir == resp || dir == both )
+                a.prefilters_resp.push_back(prefix);
+        }
+
         else if ( looking_at(chunk, i, "replaces") ) {
             eat_token(chunk, &i, "replaces");
             a.replaces = extract_id(chunk, &i);
@@ -726,6 +804,26 @@ glue::Event GlueCompiler::parseEvent(const std::string& chunk) {
     return ev;
 }
 
+// Splits a string of Spicy code into the identifiers it contains. Components
+// of scoped IDs are recorded separately.
+static void collect_ids(const std::string& code, std::set<std::string>* ids) {
+    size_t i = 0;
+
+    while ( i < code.size() ) {
+        if ( ! (isalpha(code[i]) || code[i] == '_') ) {
+            ++i;
+            continue;
+        }
+
+        size_t j = i;
+        while ( j < code.size() && (isalnum(code[j]) || code[j] == '_') )
+            ++j;
+
+        ids->insert(code.substr(i, j - i));
+        i = j;
+    }
+}
+
 bool GlueCompiler::compile() {
     auto init_module = hilti::Module(hilti::ID("spicy_init"));
 
@@ -743,6 +841,9 @@ bool GlueCompiler::compile() {
     if ( ! PopulateEvents() )
         return false;
 
+    if ( _driver->reportUnusedFields() )
+        ReportUnusedFields();
+
     for ( auto& a : _protocol_analyzers ) {
         ZEEK_DEBUG(hilti::util::fmt("Adding protocol analyzer '%s'", a.name));
 
@@ -778,7 +879,14 @@ bool GlueCompiler::compile() {
                              {builder::string(a.name), builder::id(protocol),
                               builder::vector(hilti::util::transform(a.ports, [](auto p) { return builder::port(p); })),
                               builder::string(a.unit_name_orig), builder::string(a.unit_name_resp),
-                              builder::string(a.replaces), builder::call("hilti::linker_scope", {})});
+                              builder::string(a.replaces),
+                              builder::vector(hilti::type::Bytes(),
+                                              hilti::util::transform(a.prefilters_orig,
+                                                                     [](auto p) { return builder::bytes(p); })),
+                              builder::vector(hilti::type::Bytes(),
+                                              hilti::util::transform(a.prefilters_resp,
+                                                                     [](auto p) { return builder::bytes(p); })),
+                              builder::call("hilti::linker_scope", {})});
     }
 
     for ( auto& a : _file_analyzers ) {
@@ -885,6 +993,61 @@ bool GlueCompiler::compile() {
     return true;
 }
 
+void GlueCompiler::ReportUnusedFields() {
+    // Identifiers that each unit's event expressions and conditions
+    // reference. This is a conservative over-approximation, we don't parse
+    // the expressions.
+    std::map<hilti::ID, std::set<std::string>> used;
+
+    // Units passed to events as a whole, which makes all their fields used.
+    std::set<hilti::ID> fully_used;
+
+    for ( const auto& ev : _events ) {
+        for ( const auto& e : ev.exprs ) {
+            if ( hilti::util::trim(e) == "self" )
+                fully_used.insert(ev.unit);
+
+            collect_ids(e, &used[ev.unit]);
+        }
+
+        if ( ev.condition.size() )
+            collect_ids(ev.condition, &used[ev.unit]);
+    }
+
+    // Fields that the Spicy code itself accesses (e.g., through hooks,
+    // attributes, or other fields' expressions) must be parsed as well. That
+    // code may live in any of the modules we compile, such as a separate
+    // module with Zeek-specific hooks.
+    const auto& used_by_spicy = _driver->usedFields();
+
+    std::set<hilti::ID> done;
+
+    for ( const auto& ev : _events ) {
+        if ( ! ev.unit_type || done.count(ev.unit) || fully_used.count(ev.unit) )
+            continue;
+
+        done.insert(ev.unit);
+
+        const auto& used_by_events = used[ev.unit];
+        const auto spicy = used_by_spicy.find(ev.unit);
+
+        for ( const auto& f : ev.unit_type->items<spicy::type::unit::item::Field>() ) {
+            if ( f.isAnonymous() )
+                continue;
+
+            auto name = f.id().str();
+
+            if ( used_by_events.count(name) )
+                continue;
+
+            if ( spicy != used_by_spicy.end() && spicy->second.count(name) )
+                continue;
+
+            std::cout << hilti::util::fmt("[unused field] %s::%s\n", ev.unit, name);
+        }
+    }
+}
+
 bool GlueCompiler::PopulateEvents() {
     for ( auto& ev : _events ) {
         if ( ev.unit_type )
@@ -1000,10 +1163,31 @@ bool GlueCompiler::CreateSpicyHook(glue::Event* ev) {
                                    hilti::declaration::Linkage::Private, meta);
     ev->spicy_module->spicy_module->add(std::move(handler));
 
+    // Resolve the handler's parameter types just once at initialization time.
+    auto types_id = ID(hilti::util::fmt("__zeek_handler_types_%s", mangled_event_name));
+    auto types = builder::global(types_id, builder::call("zeek_rt::event_arg_types", {builder::id(handler_id)}),
+                                 hilti::declaration::Linkage::Private, meta);
+    ev->spicy_module->spicy_module->add(std::move(types));
+
     // Create the hook body that raises the event.
     auto body = hilti::builder::Builder(_driver->context());
 
-    // If the event comes with a condition, evaluate that first.
+    // Nothing to do if there's no handler defined. Spicy cannot disable
+    // hooks at runtime, so we check this first to return before evaluating
+    // any condition or argument expressions. The check also records that
+    // the unit has made progress, see `zeek_rt::have_handler()`. In debug
+    // mode, we postpone the check so that we still log events that don't
+    // have a handler.
+    auto exit_if_no_handler = [&]() {
+        auto have_handler = builder::call("zeek_rt::have_handler", {builder::id(handler_id)}, meta);
+        auto exit_ = body.addIf(builder::not_(have_handler), meta);
+        exit_->addReturn(meta);
+    };
+
+    if ( ! _driver->hiltiOptions().debug )
+        exit_if_no_handler();
+
+    // If the event comes with a condition, evaluate that before anything else.
     if ( ev->condition.size() ) {
         auto cond = spicy::parseExpression(ev->condition, meta);
         if ( ! cond ) {
@@ -1042,15 +1226,14 @@ bool GlueCompiler::CreateSpicyHook(glue::Event* ev) {
         auto msg = builder::modulo(builder::string(fmt_str), builder::tuple(std::move(fmt_args)));
         auto call = builder::call("zeek_rt::debug", {std::move(msg)});
         body.addExpression(call);
-    }
 
-    // Nothing to do if there's not handler defined.
-    auto have_handler = builder::call("zeek_rt::have_handler", {builder::id(handler_id)}, meta);
-    auto exit_ = body.addIf(builder::not_(have_handler), meta);
-    exit_->addReturn(meta);
+        exit_if_no_handler();
+    }
 
     // Build event's argument vector.
-    body.addLocal(ID("args"), hilti::type::Vector(builder::typeByID("zeek_rt::Val"), meta), meta);
+    auto num_args = builder::integer(static_cast<int>(ev->expression_accessors.size()));
+    body.addLocal(ID("args"), builder::typeByID("zeek_rt::EventArgs"),
+                  builder::call("zeek_rt::event_args", {std::move(num_args)}, meta), meta);
 
     int i = 0;
     for ( const auto& e : ev->expression_accessors ) {
@@ -1077,11 +1260,11 @@ bool GlueCompiler::CreateSpicyHook(glue::Event* ev) {
             }
 
             auto ztype = builder::call("zeek_rt::event_arg_type",
-                                       {builder::id(handler_id), builder::integer(i), location(e)}, meta);
+                                       {builder::id(types_id), builder::integer(i), location(e)}, meta);
             val = builder::call("zeek_rt::to_val", {std::move(*expr), ztype, location(e)}, meta);
         }
 
-        body.addMemberCall(builder::id("args"), "push_back", {val}, meta);
+        body.addCall("zeek_rt::event_arg_push", {builder::id("args"), std::move(val), location(e)}, meta);
         i++;
     }
 
@@ -1,7 +1,20 @@
 // Copyright (c) 2020-2021 by the Zeek Project. See LICENSE for details.
 
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+
 #include <hilti/ast/types/enum.h>
 
+#include <zeek-spicy/autogen/config.h>
 #include <zeek-spicy/driver.h>
 #include <zeek-spicy/zeek-reporter.h>
 
@@ -11,6 +24,42 @@ const hilti::logging::DebugStream ZeekPlugin("zeek");
 
 using namespace spicy::zeek;
 
+namespace {
+// Incremental 64-bit FNV-1a hash.
+class Hash {
+public:
+    void add(const std::string& data) {
+        for ( auto c : data ) {
+            _hash ^= static_cast<unsigned char>(c);
+            _hash *= 1099511628211ULL;
+        }
+
+        // Separate consecutive items.
+        _hash ^= 0xff;
+        _hash *= 1099511628211ULL;
+    }
+
+    std::string str() const { return hilti::rt::fmt("%016" PRIx64, _hash); }
+
+private:
+    uint64_t _hash = 14695981039346656037ULL;
+};
+
+// Returns a hash of a file's content, or nothing if it cannot be read.
+std::optional<std::string> hashFile(const hilti::rt::filesystem::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    if ( ! in )
+        return {};
+
+    std::stringstream content;
+    content << in.rdbuf();
+
+    Hash hash;
+    hash.add(content.str());
+    return hash.str();
+}
+} // namespace
+
 void plugin::Zeek_Spicy::Driver::InitPreScript() {
     if ( auto opts = hilti::rt::getenv("ZEEK_SPICY_PLUGIN_OPTIONS") ) {
         if ( auto rc = Driver::parseOptionsPreScript(*opts); ! rc )
@@ -23,6 +72,40 @@ void plugin::Zeek_Spicy::Driver::InitPostScript() {
         ZEEK_DEBUG(hilti::rt::fmt("Loading input file %s", p));
         if ( auto rc = loadFile(p); ! rc )
             reporter::fatalError(hilti::rt::fmt("error loading %s: %s", p, rc.error().description()));
+
+        _inputs.emplace_back(p);
+    }
+
+    // With a JIT cache, the first process to get here compiles the inputs
+    // into an HLTO inside the cache directory, holding the directory's lock
+    // while doing so. All others wait for the lock and then reuse that
+    // HLTO. A single lock file for the whole directory serializes compiling
+    // different entries, but leaves nothing behind per entry.
+    int lock = -1;
+
+    if ( ! _cache_dir.empty() ) {
+        auto key = _cacheKey();
+        _cached_module = _cache_dir / (key + ".hlto");
+        auto deps = _cache_dir / (key + ".deps");
+
+        if ( _isCacheEntryCurrent(*_cached_module, deps) ) {
+            ZEEK_DEBUG(hilti::rt::fmt("Using cached module %s", _cached_module->native()));
+            return;
+        }
+
+        auto lock_path = _cache_dir / ".lock";
+        lock = ::open(lock_path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+        if ( lock < 0 || ::flock(lock, LOCK_EX) != 0 )
+            reporter::fatalError(hilti::rt::fmt("cannot lock JIT cache %s: %s", lock_path, strerror(errno)));
+
+        if ( _isCacheEntryCurrent(*_cached_module, deps) ) {
+            ZEEK_DEBUG(hilti::rt::fmt("Using cached module %s compiled by another process",
+                                      _cached_module->native()));
+            ::close(lock);
+            return;
+        }
+
+        ZEEK_DEBUG(hilti::rt::fmt("No cached module %s, compiling", _cached_module->native()));
     }
 
     // Compile all the inputs.
@@ -37,6 +120,26 @@ void plugin::Zeek_Spicy::Driver::InitPostScript() {
         reporter::fatalError(hilti::rt::fmt("error during compilation: %s", rc.error().description()));
     }
 
+    if ( _cached_module ) {
+        // With an output path set, HILTI's driver saves the linked code
+        // there instead of loading it into the current process, just as for
+        // precompilation below. So the plugin loading the cached module
+        // afterwards is the only time it gets loaded.
+        //
+        // Renaming is atomic, so other processes never see a partial file.
+        std::error_code ec;
+        hilti::rt::filesystem::rename(driverOptions().output_path, *_cached_module, ec);
+        if ( ec )
+            reporter::fatalError(hilti::rt::fmt("cannot save %s to JIT cache: %s", *_cached_module, ec.message()));
+
+        // Write the dependencies only after the module is in place: a
+        // process looking at the two in between sees an outdated entry and
+        // waits for the lock.
+        _saveCacheDependencies(_cache_dir / (_cached_module->stem().native() + ".deps"));
+        ::close(lock);
+        return;
+    }
+
     if ( ! driverOptions().output_path.empty() )
         // If an output path is set, we're in precompilation mode, just exit.
         exit(0);
@@ -57,6 +160,7 @@ int plugin::Zeek_Spicy::Driver::HookLoadFile(const zeek::plugin::Plugin::LoadTyp
             return 0;
         }
 
+        _inputs.emplace_back(resolved.size() ? resolved : file);
         return 1;
     }
 
@@ -126,6 +230,21 @@ void plugin::Zeek_Spicy::Driver::_initialize() {
             reporter::fatalError(hilti::rt::fmt("error parsing ZEEK_SPICY_PLUGIN_OPTIONS, %s", rc.error()));
     }
 
+    // If enabled, JIT compilation goes into an HLTO inside the cache
+    // directory that the plugin then loads like any precompiled module.
+    // Explicitly requested precompilation takes precedence.
+    auto cache_dir = ::zeek::id::find_const("Spicy::jit_cache_dir")->AsStringVal()->ToStdString();
+    if ( cache_dir.size() && driver_options.output_path.empty() ) {
+        _cache_dir = cache_dir;
+
+        std::error_code ec;
+        hilti::rt::filesystem::create_directories(_cache_dir, ec);
+        if ( ec )
+            reporter::fatalError(hilti::rt::fmt("cannot create JIT cache directory %s: %s", _cache_dir, ec.message()));
+
+        driver_options.output_path = _cache_dir / hilti::rt::fmt(".tmp.%d.hlto", getpid());
+    }
+
     setCompilerOptions(std::move(hilti_options));
     setDriverOptions(std::move(driver_options));
 
@@ -133,6 +252,103 @@ void plugin::Zeek_Spicy::Driver::_initialize() {
     _initialized = true;
 }
 
+std::string plugin::Zeek_Spicy::Driver::_cacheKey() const {
+    // Hash everything going into compilation that's known upfront. Modules
+    // that the inputs import are resolved only while compiling, so these get
+    // validated separately through the entry's dependency file.
+    Hash hash;
+
+    hash.add(spicy::zeek::configuration::PluginVersion);
+    hash.add(std::to_string(spicy::zeek::configuration::ZeekVersionNumber));
+    hash.add(std::to_string(SPICY_VERSION_NUMBER));
+
+    for ( const auto& c : {"Spicy::debug", "Spicy::optimize", "Spicy::skip_validation"} )
+        hash.add(std::to_string(::zeek::id::find_const(c)->AsBool()));
+
+    hash.add(::zeek::id::find_const("Spicy::debug_addl")->AsStringVal()->ToStdString());
+    hash.add(hilti::rt::getenv("ZEEK_SPICY_PLUGIN_OPTIONS").value_or(""));
+
+    for ( const auto& p : _inputs ) {
+        auto path = p;
+        if ( ! hilti::rt::filesystem::exists(path) ) {
+            if ( auto x = hilti::util::findInPaths(path, hiltiOptions().library_paths) )
+                path = *x;
+        }
+
+        hash.add(path.native());
+        hash.add(hashFile(path).value_or(""));
+    }
+
+    for ( const auto& dir : hiltiOptions().library_paths )
+        hash.add(dir.native());
+
+    return hash.str();
+}
+
+bool plugin::Zeek_Spicy::Driver::_isCacheEntryCurrent(const hilti::rt::filesystem::path& module,
+                                                      const hilti::rt::filesystem::path& deps) const {
+    if ( ! hilti::rt::filesystem::exists(module) )
+        return false;
+
+    std::ifstream in(deps);
+    if ( ! in ) {
+        ZEEK_DEBUG(hilti::rt::fmt("Cached module %s has no dependency information", module.native()));
+        return false;
+    }
+
+    // Each line records the content hash of one module that compilation
+    // resolved, followed by its path.
+    std::string line;
+    while ( std::getline(in, line) ) {
+        auto sep = line.find(' ');
+        if ( sep == std::string::npos )
+            return false;
+
+        auto path = hilti::rt::filesystem::path(line.substr(sep + 1));
+        if ( hashFile(path) != line.substr(0, sep) ) {
+            ZEEK_DEBUG(hilti::rt::fmt("Cached module %s is outdated, %s changed", module.native(), path.native()));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void plugin::Zeek_Spicy::Driver::_saveCacheDependencies(const hilti::rt::filesystem::path& deps) const {
+    auto tmp = _cache_dir / hilti::rt::fmt(".tmp.%d.deps", getpid());
+
+    {
+        std::ofstream out(tmp);
+
+        for ( const auto& m : _resolved_modules ) {
+            if ( auto hash = hashFile(m) )
+                out << *hash << ' ' << m.native() << '\n';
+        }
+
+        if ( ! out ) {
+            reporter::warning(hilti::rt::fmt("cannot write JIT cache dependencies %s", tmp));
+            return;
+        }
+    }
+
+    std::error_code ec;
+    hilti::rt::filesystem::rename(tmp, deps, ec);
+    if ( ec )
+        reporter::warning(hilti::rt::fmt("cannot save JIT cache dependencies %s: %s", deps, ec.message()));
+}
+
+void plugin::Zeek_Spicy::Driver::hookNewASTPreCompilation(std::shared_ptr<hilti::Unit> unit) {
+    spicy::zeek::Driver::hookNewASTPreCompilation(unit);
+
+    // Remember where the compiler found each module, including imported
+    // ones, so that the JIT cache can tell when any of them changes.
+    if ( ! unit->path().empty() ) {
+        std::error_code ec;
+        auto path = hilti::rt::filesystem::absolute(unit->path(), ec);
+        _resolved_modules.insert(ec ? unit->path() : path);
+    }
+}
+
 void plugin::Zeek_Spicy::Driver::hookNewEnumType(const EnumInfo& e) {
     // Because we are running live within a Zeek, register the new enum type
     // immediately so that it'll be available when subsequent scripts are
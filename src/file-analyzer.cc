@@ -30,10 +30,8 @@ static auto create_file_state(FileAnalyzer* analyzer) {
             depth = f->depth + 1;
     }
 
-    cookie::FileAnalyzer cookie{.analyzer = analyzer,
-                                .depth = depth,
-                                .fstate = cookie::FileStateStack(analyzer->GetFile()->GetID())};
-    return FileState(cookie);
+    cookie::FileAnalyzer cookie{.analyzer = analyzer, .depth = depth};
+    return FileState(std::move(cookie));
 }
 
 FileAnalyzer::FileAnalyzer(::zeek::RecordValPtr args, ::zeek::file_analysis::File* file)
@@ -93,11 +91,29 @@ bool FileAnalyzer::Process(int len, const u_char* data) {
         return false;
     }
 
+    const auto& max_buffered_bytes = ::zeek::BifConst::Spicy::max_buffered_bytes;
+    const auto& max_total_pending_bytes = ::zeek::BifConst::Spicy::max_total_pending_bytes;
+
+    // Track pending input if a limit needs it; the parser resets the count
+    // whenever it calls back into Zeek.
+    if ( rt::detail::track_progress && ! _state.isSkipping() )
+        _state.cookie().buffered += len;
+
+    auto& stats = OurPlugin->statisticsForFileAnalyzer(_state.cookie().analyzer->Tag());
+    StatisticsTimer timer(::zeek::BifConst::Spicy::stats_timing ? &stats : nullptr);
+    ++stats.chunks;
+    stats.bytes += len;
+
+    if ( _state.isSkipping() )
+        stats.bytes_skipped += len;
+
     try {
         hilti::rt::context::CookieSetter _(&_state.cookie());
+        BudgetedAnalyzer::Active active(this);
         _state.process(len, reinterpret_cast<const char*>(data));
     } catch ( const spicy::rt::ParseError& e ) {
         STATE_DEBUG_MSG(hilti::rt::fmt("parse error, triggering analyzer violation: %s", e.what()));
+        ++stats.parse_errors;
         auto tag = OurPlugin->tagForFileAnalyzer(_state.cookie().analyzer->Tag());
         spicy::zeek::compat::Analyzer_AnalyzerViolation(_state.cookie().analyzer, e.what(), nullptr, 0, tag);
     } catch ( const hilti::rt::Exception& e ) {
@@ -106,15 +122,53 @@ bool FileAnalyzer::Process(int len, const u_char* data) {
                                 e.location()); // this sets Zeek to skip sending any further input
     }
 
+    // Check the limit only now that the parser has seen the input, so that
+    // a chunk that it makes progress on doesn't count against it.
+    if ( max_buffered_bytes && _state.cookie().buffered > max_buffered_bytes && ! _state.isSkipping() ) {
+        auto& buffered = _state.cookie().buffered;
+        STATE_DEBUG_MSG(
+            hilti::rt::fmt("%" PRIu64 " bytes buffered without progress, skipping further input", buffered));
+        ::zeek::reporter->Weird(file, "spicy_max_buffered_bytes_exceeded",
+                                hilti::rt::fmt("%" PRIu64 " bytes", buffered).c_str());
+
+        // Resetting drops the unit instance, its input stream, and any suspended fiber.
+        _state.reset();
+        _state.skipRemaining();
+        buffered = 0;
+    }
+
+    if ( max_total_pending_bytes ) {
+        auto& budget = OurPlugin->pendingInputBudget();
+        budget.charge(this, _state.cookie().buffered);
+        budget.enforce(max_total_pending_bytes);
+    }
+
     return true;
 }
 
+void FileAnalyzer::evictFromBudget() {
+    auto& buffered = _state.cookie().buffered;
+
+    STATE_DEBUG_MSG(hilti::rt::fmt("evicted with %" PRIu64 " bytes pending, skipping further input", buffered));
+    ::zeek::reporter->Weird(_state.cookie().analyzer->GetFile(), "spicy_max_total_pending_bytes_exceeded",
+                            hilti::rt::fmt("%" PRIu64 " bytes", buffered).c_str());
+
+    // Resetting drops the unit instance, its input stream, and any suspended fiber.
+    _state.reset();
+    _state.skipRemaining();
+    buffered = 0;
+}
+
 void FileAnalyzer::Finish() {
+    auto& stats = OurPlugin->statisticsForFileAnalyzer(_state.cookie().analyzer->Tag());
+    StatisticsTimer timer(::zeek::BifConst::Spicy::stats_timing ? &stats : nullptr);
+
     try {
         hilti::rt::context::CookieSetter _(&_state.cookie());
         _state.finish();
     } catch ( const spicy::rt::ParseError& e ) {
         STATE_DEBUG_MSG(hilti::rt::fmt("parse error, triggering analyzer violation: %s", e.what()));
+        ++stats.parse_errors;
         auto tag = OurPlugin->tagForFileAnalyzer(_state.cookie().analyzer->Tag());
         spicy::zeek::compat::Analyzer_AnalyzerViolation(_state.cookie().analyzer, e.what(), nullptr, 0, tag);
     } catch ( const hilti::rt::Exception& e ) {
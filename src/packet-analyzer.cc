@@ -6,6 +6,8 @@
 #include <zeek-spicy/runtime-support.h>
 #include <zeek-spicy/zeek-reporter.h>
 
+#include "consts.bif.h"
+
 #ifndef NDEBUG
 #define STATE_DEBUG_MSG(...) DebugMsg(__VA_ARGS__)
 #else
@@ -30,10 +32,25 @@ PacketAnalyzer::PacketAnalyzer(std::string name)
 PacketAnalyzer::~PacketAnalyzer() = default;
 
 bool PacketAnalyzer::AnalyzePacket(size_t len, const uint8_t* data, ::zeek::Packet* packet) {
-    if ( auto parser = OurPlugin->parserForPacketAnalyzer(_state.cookie().analyzer->GetAnalyzerTag()) )
-        _state.setParser(parser);
-    else
-        reporter::fatalError("no valid unit specified for parsing");
+    if ( ! _parser ) {
+        // Bind the parser once on first use; the plugin's analyzer tables
+        // are complete by the time packets arrive.
+        auto tag = _state.cookie().analyzer->GetAnalyzerTag();
+
+        _parser = OurPlugin->parserForPacketAnalyzer(tag);
+        if ( ! _parser )
+            reporter::fatalError("no valid unit specified for parsing");
+
+        _stats = &OurPlugin->statisticsForPacketAnalyzer(tag);
+    }
+
+    if ( ! _state.hasParser() )
+        _state.setParser(_parser);
+
+    auto& stats = *_stats;
+    StatisticsTimer timer(::zeek::BifConst::Spicy::stats_timing ? &stats : nullptr);
+    ++stats.chunks;
+    stats.bytes += len;
 
     try {
         hilti::rt::context::CookieSetter _(&_state.cookie());
@@ -56,6 +73,7 @@ bool PacketAnalyzer::AnalyzePacket(size_t len, const uint8_t* data, ::zeek::Pack
             return true;
     } catch ( const spicy::rt::ParseError& e ) {
         STATE_DEBUG_MSG(hilti::rt::fmt("parse error, triggering analyzer violation: %s", e.what()));
+        ++stats.parse_errors;
         auto tag = _state.cookie().analyzer->GetAnalyzerTag();
         spicy::zeek::compat::Analyzer_AnalyzerViolation(*packet, _state.cookie().analyzer, e.what(), nullptr, 0, tag);
         _state.reset();
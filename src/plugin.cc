@@ -3,10 +3,16 @@
 #include <dlfcn.h>
 #include <glob.h>
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#endif
+
 #include <exception>
+#include <functional>
 
 #include <hilti/rt/autogen/version.h>
 #include <hilti/rt/configuration.h>
+#include <hilti/rt/fiber.h>
 #include <hilti/rt/filesystem.h>
 #include <hilti/rt/fmt.h>
 #include <hilti/rt/init.h>
@@ -23,6 +29,7 @@
 #include <zeek-spicy/packet-analyzer.h>
 #include <zeek-spicy/plugin.h>
 #include <zeek-spicy/protocol-analyzer.h>
+#include <zeek-spicy/runtime-support.h>
 #include <zeek-spicy/zeek-compat.h>
 #include <zeek-spicy/zeek-reporter.h>
 
@@ -97,6 +104,8 @@ void plugin::Zeek_Spicy::Plugin::registerProtocolAnalyzer(const std::string& nam
                                                           const hilti::rt::Vector<hilti::rt::Port>& ports,
                                                           const std::string& parser_orig,
                                                           const std::string& parser_resp, const std::string& replaces,
+                                                          const hilti::rt::Vector<hilti::rt::Bytes>& prefilters_orig,
+                                                          const hilti::rt::Vector<hilti::rt::Bytes>& prefilters_resp,
                                                           const std::string& linker_scope) {
     ZEEK_DEBUG(hilti::rt::fmt("Have Spicy protocol analyzer %s", name));
 
@@ -110,6 +119,12 @@ void plugin::Zeek_Spicy::Plugin::registerProtocolAnalyzer(const std::string& nam
     info.ports = ports;
     info.linker_scope = linker_scope;
 
+    for ( const auto& p : prefilters_orig )
+        info.prefilters_orig.emplace_back(p.str());
+
+    for ( const auto& p : prefilters_resp )
+        info.prefilters_resp.emplace_back(p.str());
+
     if ( replaces.size() ) {
         if ( auto tag = ::zeek::analyzer_mgr->GetAnalyzerTag(replaces.c_str()) ) {
             ZEEK_DEBUG(hilti::rt::fmt("  Replaces existing protocol analyzer %s", replaces));
@@ -317,6 +332,84 @@ const spicy::rt::Parser* plugin::Zeek_Spicy::Plugin::parserForPacketAnalyzer(
     return tag;
 }
 
+::zeek::TableValPtr plugin::Zeek_Spicy::Plugin::statistics() {
+    auto record_type = ::zeek::id::find_type<::zeek::RecordType>("Spicy::AnalyzerStats");
+    auto table_type = ::zeek::id::find_type<::zeek::TableType>("Spicy::AnalyzerStatsTable");
+    auto table = ::zeek::make_intrusive<::zeek::TableVal>(table_type);
+
+    auto add = [&](const std::string& name, const char* kind, const spicy::zeek::rt::AnalyzerStatistics& stats) {
+        auto rv = ::zeek::make_intrusive<::zeek::RecordVal>(record_type);
+        rv->Assign(0, ::zeek::val_mgr->Count(stats.bytes));
+        rv->Assign(1, ::zeek::val_mgr->Count(stats.chunks));
+        rv->Assign(2, ::zeek::val_mgr->Count(stats.parse_errors));
+        rv->Assign(3, ::zeek::val_mgr->Count(stats.events));
+        rv->Assign(4, ::zeek::make_intrusive<::zeek::IntervalVal>(stats.wall_time));
+        rv->Assign(5, ::zeek::make_intrusive<::zeek::IntervalVal>(stats.cpu_time));
+        rv->Assign(6, ::zeek::val_mgr->Count(stats.bytes_skipped));
+
+        // Analyzers of different kinds may share a name, so the kind is part of the index.
+        auto index = ::zeek::make_intrusive<::zeek::ListVal>(::zeek::TYPE_STRING);
+        index->Append(::zeek::make_intrusive<::zeek::StringVal>(kind));
+        index->Append(::zeek::make_intrusive<::zeek::StringVal>(name));
+        table->Assign(std::move(index), std::move(rv));
+    };
+
+    for ( const auto& p : _protocol_analyzers_by_type ) {
+        if ( p.type != 0 )
+            add(p.name_analyzer, "protocol", p.stats);
+    }
+
+    for ( const auto& p : _file_analyzers_by_type ) {
+        if ( p.type != 0 )
+            add(p.name_analyzer, "file", p.stats);
+    }
+
+    for ( const auto& p : _packet_analyzers_by_type ) {
+        if ( p.type != 0 )
+            add(p.name_analyzer, "packet", p.stats);
+    }
+
+    return table;
+}
+
+::zeek::RecordValPtr plugin::Zeek_Spicy::Plugin::resourceUsage() {
+    auto record_type = ::zeek::id::find_type<::zeek::RecordType>("Spicy::ResourceUsage");
+    auto fibers = hilti::rt::detail::Fiber::statistics();
+
+    auto rv = ::zeek::make_intrusive<::zeek::RecordVal>(record_type);
+    rv->Assign(0, ::zeek::val_mgr->Count(fibers.current));
+    rv->Assign(1, ::zeek::val_mgr->Count(fibers.cached));
+    rv->Assign(2, ::zeek::val_mgr->Count(fibers.total));
+    rv->Assign(3, ::zeek::val_mgr->Count(fibers.max));
+    return rv;
+}
+
+::zeek::RecordValPtr plugin::Zeek_Spicy::Plugin::bufferedBytes(::zeek::Val* cid) {
+    uint64_t orig = 0;
+    uint64_t resp = 0;
+
+    std::function<void(::zeek::analyzer::Analyzer*)> collect = [&](::zeek::analyzer::Analyzer* a) {
+        if ( auto* x = dynamic_cast<spicy::zeek::rt::ProtocolAnalyzer*>(a) ) {
+            orig += x->originator().cookie().buffered;
+            resp += x->responder().cookie().buffered;
+        }
+
+        for ( auto* child : a->GetChildren() )
+            collect(child);
+    };
+
+    if ( auto* conn = spicy::zeek::compat::SessionMgr_FindConnection(cid) ) {
+        if ( auto* root = spicy::zeek::compat::Connection_RootAnalyzer(conn) )
+            collect(root);
+    }
+
+    auto record_type = ::zeek::id::find_type<::zeek::RecordType>("Spicy::BufferedBytes");
+    auto rv = ::zeek::make_intrusive<::zeek::RecordVal>(record_type);
+    rv->Assign(0, ::zeek::val_mgr->Count(orig));
+    rv->Assign(1, ::zeek::val_mgr->Count(resp));
+    return rv;
+}
+
 bool plugin::Zeek_Spicy::Plugin::toggleProtocolAnalyzer(const ::spicy::zeek::compat::AnalyzerTag& tag, bool enable) {
     auto type = tag.Type();
 
@@ -503,6 +596,9 @@ void plugin::Zeek_Spicy::Plugin::InitPostScript() {
 
 #ifdef ZEEK_SPICY_PLUGIN_USE_JIT
     _driver->InitPostScript();
+
+    if ( const auto& hlto = _driver->cachedModule() )
+        loadModule(*hlto);
 #endif
 
     // If there's no handler for one of our events, it won't have received a
@@ -515,8 +611,16 @@ void plugin::Zeek_Spicy::Plugin::InitPostScript() {
                                                                ::zeek::FUNC_FLAVOR_EVENT);
             id->SetType(std::move(et));
         }
+
+        // Checking for a handler is the first thing that generated hooks do.
+        if ( ! ::zeek::EventHandlerPtr(::zeek::event_registry->Lookup(name)) )
+            ZEEK_DEBUG(hilti::rt::fmt("Event %s does not have any handlers, its Spicy hooks will return right away",
+                                      name));
     }
 
+    spicy::zeek::rt::detail::track_progress = ::zeek::id::find_const("Spicy::max_buffered_bytes")->AsCount() ||
+                                              ::zeek::id::find_const("Spicy::max_total_pending_bytes")->AsCount();
+
     // Init runtime, which will trigger all initialization code to execute.
     ZEEK_DEBUG("Initializing Spicy runtime");
 
@@ -530,6 +634,30 @@ void plugin::Zeek_Spicy::Plugin::InitPostScript() {
     config.abort_on_exceptions = ::zeek::id::find_const("Spicy::abort_on_exceptions")->AsBool();
     config.show_backtraces = ::zeek::id::find_const("Spicy::show_backtraces")->AsBool();
 
+    if ( auto size = ::zeek::id::find_const("Spicy::fiber_stack_size")->AsCount() ) {
+#if SPICY_VERSION_NUMBER >= 10500
+        config.fiber_individual_stack_size = size;
+#else
+        config.fiber_stack_size = size;
+#endif
+    }
+
+    if ( auto size = ::zeek::id::find_const("Spicy::fiber_shared_stack_size")->AsCount() ) {
+#if SPICY_VERSION_NUMBER >= 10500
+        config.fiber_shared_stack_size = size;
+#else
+        reporter::warning("Spicy::fiber_shared_stack_size requires Spicy 1.5 or later, ignoring");
+#endif
+    }
+
+    if ( auto size = ::zeek::id::find_const("Spicy::fiber_cache_size")->AsInt(); size >= 0 ) {
+#if SPICY_VERSION_NUMBER >= 10500
+        config.fiber_cache_size = size;
+#else
+        reporter::warning("Spicy::fiber_cache_size requires Spicy 1.5 or later, ignoring");
+#endif
+    }
+
     hilti::rt::configuration::set(config);
 
     try {
@@ -564,6 +692,8 @@ void plugin::Zeek_Spicy::Plugin::InitPostScript() {
         return nullptr; // cannot be reached
     };
 
+    auto coalesce = ::zeek::id::find_const("Spicy::tcp_coalesce_bytes")->AsTableVal();
+
     for ( auto& p : _protocol_analyzers_by_type ) {
         if ( p.type == 0 )
             // vector element not set
@@ -579,6 +709,12 @@ void plugin::Zeek_Spicy::Plugin::InitPostScript() {
         if ( ! tag )
             reporter::internalError(hilti::rt::fmt("cannot get analyzer tag for '%s'", p.name_analyzer));
 
+        // Pick up any TCP coalescing configured for the analyzer.
+        if ( auto v = coalesce->FindOrDefault(tag.AsVal()) ) {
+            ZEEK_DEBUG(hilti::rt::fmt("  Coalescing TCP input up to %u bytes", v->AsCount()));
+            p.coalesce_bytes = v->AsCount();
+        }
+
         for ( auto port : p.ports ) {
             ZEEK_DEBUG(hilti::rt::fmt("  Scheduling analyzer for port %s", port));
             ::zeek::analyzer_mgr->RegisterAnalyzerForPort(tag, transport_protocol(port), port.port());
@@ -649,22 +785,106 @@ void plugin::Zeek_Spicy::Plugin::Done() {
     hilti::rt::done();
 }
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && (defined(__clang__) || __GNUC__ < 12)
+// Returns true if CPUID reports all the given bits set in a register.
+static bool cpuid_has(unsigned int leaf, unsigned int subleaf, int reg, unsigned int bits) {
+    unsigned int r[4] = {0, 0, 0, 0};
+    if ( ! __get_cpuid_count(leaf, subleaf, &r[0], &r[1], &r[2], &r[3]) )
+        return false;
+
+    return (r[reg] & bits) == bits;
+}
+
+// Returns true if the OS saves all the given register state on context switches.
+static bool os_saves_state(uint64_t mask) {
+    if ( ! cpuid_has(1, 0, 2, 1u << 27) ) // OSXSAVE
+        return false;
+
+    uint32_t eax = 0;
+    uint32_t edx = 0;
+    asm volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((static_cast<uint64_t>(edx) << 32 | eax) & mask) == mask;
+}
+#endif
+
+// Returns the x86-64 microarchitecture levels that the current CPU supports,
+// best first.
+static std::vector<std::string> supported_cpu_levels() {
+    std::vector<std::string> levels;
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#if ! defined(__clang__) && __GNUC__ >= 12
+    __builtin_cpu_init();
+
+    bool v2 = __builtin_cpu_supports("x86-64-v2");
+    bool v3 = __builtin_cpu_supports("x86-64-v3");
+    bool v4 = __builtin_cpu_supports("x86-64-v4");
+#else
+    // Check each level's full feature list as defined by the x86-64 psABI,
+    // as code built for a level may use any of them. Registers are indexed
+    // as EAX=0, EBX=1, ECX=2, EDX=3.
+    constexpr int ebx = 1;
+    constexpr int ecx = 2;
+
+    // SSE3, SSSE3, CMPXCHG16B, SSE4.1, SSE4.2, POPCNT; LAHF/SAHF.
+    bool v2 = cpuid_has(1, 0, ecx, (1u << 0) | (1u << 9) | (1u << 13) | (1u << 19) | (1u << 20) | (1u << 23)) &&
+              cpuid_has(0x80000001, 0, ecx, 1u << 0);
+
+    // FMA, MOVBE, AVX, F16C; LZCNT; BMI1, AVX2, BMI2; OS support for AVX state.
+    bool v3 = v2 && cpuid_has(1, 0, ecx, (1u << 12) | (1u << 22) | (1u << 28) | (1u << 29)) &&
+              cpuid_has(0x80000001, 0, ecx, 1u << 5) && cpuid_has(7, 0, ebx, (1u << 3) | (1u << 5) | (1u << 8)) &&
+              os_saves_state(0x6);
+
+    // AVX512F, AVX512DQ, AVX512CD, AVX512BW, AVX512VL; OS support for AVX-512 state.
+    bool v4 = v3 && cpuid_has(7, 0, ebx, (1u << 16) | (1u << 17) | (1u << 28) | (1u << 30) | (1u << 31)) &&
+              os_saves_state(0xe6);
+#endif
+
+    if ( v4 )
+        levels.emplace_back("x86-64-v4");
+
+    if ( v3 )
+        levels.emplace_back("x86-64-v3");
+
+    if ( v2 )
+        levels.emplace_back("x86-64-v2");
+#endif
+
+    return levels;
+}
+
 void plugin::Zeek_Spicy::Plugin::loadModule(const hilti::rt::filesystem::path& path) {
     try {
         // If our auto discovery ends up finding the same module multiple times,
         // we ignore subsequent requests.
         auto canonical_path = hilti::rt::filesystem::canonical(path);
 
-        if ( auto [library, inserted] = _libraries.insert({canonical_path, hilti::rt::Library(canonical_path)});
-             inserted ) {
-            ZEEK_DEBUG(hilti::rt::fmt("Loading %s", canonical_path.native()));
-            if ( auto load = library->second.open(); ! load )
-                hilti::rt::fatalError(
-                    hilti::rt::fmt("could not open library path %s: %s", canonical_path, load.error()));
-        }
-        else {
+        if ( _libraries.find(canonical_path) != _libraries.end() ) {
             ZEEK_DEBUG(hilti::rt::fmt("Ignoring duplicate loading request for %s", canonical_path.native()));
+            return;
         }
+
+        // If there are variants of the module built for specific CPU levels,
+        // named "<module>.hlto.<level>", load the best one the CPU supports.
+        static const auto cpu_levels = supported_cpu_levels();
+
+        auto load_path = canonical_path;
+
+        for ( const auto& level : cpu_levels ) {
+            auto variant = canonical_path;
+            variant += "." + level;
+
+            if ( hilti::rt::filesystem::exists(variant) ) {
+                load_path = variant;
+                break;
+            }
+        }
+
+        auto library = _libraries.insert({canonical_path, hilti::rt::Library(load_path)}).first;
+
+        ZEEK_DEBUG(hilti::rt::fmt("Loading %s", load_path.native()));
+        if ( auto load = library->second.open(); ! load )
+            hilti::rt::fatalError(hilti::rt::fmt("could not open library path %s: %s", load_path, load.error()));
     } catch ( const hilti::rt::EnvironmentError& e ) {
         hilti::rt::fatalError(e.what());
     }
@@ -701,15 +921,66 @@ void plugin::Zeek_Spicy::Plugin::searchModules(const std::string& paths) {
             continue;
         }
 
+        // Normalize the path so that we can recognize directories we have
+        // searched already (e.g., through a symlink or an overlapping
+        // entry). Below that, paths remain normalized as we don't follow
+        // symlinks, so we can compare them without touching the file system.
+        std::error_code root_ec;
+        auto root = hilti::rt::filesystem::canonical(trimmed_dir, root_ec);
+        if ( root_ec ) {
+            ZEEK_DEBUG(
+                hilti::rt::fmt("Cannot resolve module directory %s, skipping: %s", trimmed_dir, root_ec.message()));
+            continue;
+        }
+
+        if ( ! markDirectorySearched(root) ) {
+            ZEEK_DEBUG(hilti::rt::fmt("Module directory %s has been searched already, skipping", trimmed_dir));
+            continue;
+        }
+
         ZEEK_DEBUG(hilti::rt::fmt("Searching %s for *.hlto", trimmed_dir));
 
-        for ( const auto& e : hilti::rt::filesystem::recursive_directory_iterator(trimmed_dir) ) {
-            if ( e.is_regular_file() && e.path().extension() == ".hlto" )
-                loadModule(e.path());
+        // Plugin directories may live on slow network file systems, so we
+        // avoid any file system access beyond what's needed: we look at the
+        // extension first and don't walk any directory twice. We walk each
+        // directory separately so that an error in one of them doesn't end
+        // the search of the others.
+        std::vector<hilti::rt::filesystem::path> pending = {root};
+
+        while ( ! pending.empty() ) {
+            auto current = std::move(pending.back());
+            pending.pop_back();
+
+            std::error_code ec;
+            auto options = hilti::rt::filesystem::directory_options::skip_permission_denied;
+            hilti::rt::filesystem::directory_iterator i(current, options, ec);
+
+            for ( ; ! ec && i != hilti::rt::filesystem::directory_iterator(); i.increment(ec) ) {
+                const auto& path = i->path();
+                std::error_code entry_ec;
+
+                if ( path.extension() == ".hlto" ) {
+                    if ( i->is_regular_file(entry_ec) )
+                        loadModule(path);
+
+                    continue;
+                }
+
+                // Like a recursive iterator, don't follow symlinks to directories.
+                if ( i->is_directory(entry_ec) && ! i->is_symlink(entry_ec) && markDirectorySearched(path) )
+                    pending.push_back(path);
+            }
+
+            if ( ec )
+                reporter::warning(hilti::rt::fmt("error searching %s for Spicy modules: %s", current, ec.message()));
         }
     }
 };
 
+bool plugin::Zeek_Spicy::Plugin::markDirectorySearched(const hilti::rt::filesystem::path& dir) {
+    return _searched_directories.insert(dir.native()).second;
+}
+
 ::zeek::detail::Location plugin::Zeek_Spicy::Plugin::makeLocation(const std::string& fname) {
     auto x = _locations.insert(fname);
     return ::zeek::detail::Location(x.first->c_str(), 0, 0, 0, 0);
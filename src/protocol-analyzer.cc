@@ -1,5 +1,11 @@
 // Copyright (c) 2020-2021 by the Zeek Project. See LICENSE for details.
 
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+
 #include <zeek-spicy/autogen/config.h>
 #include <zeek-spicy/plugin.h>
 #include <zeek-spicy/protocol-analyzer.h>
@@ -7,6 +13,8 @@
 #include <zeek-spicy/zeek-compat.h>
 #include <zeek-spicy/zeek-reporter.h>
 
+#include "consts.bif.h"
+
 using namespace spicy::zeek;
 using namespace spicy::zeek::rt;
 using namespace plugin::Zeek_Spicy;
@@ -20,18 +28,16 @@ using namespace plugin::Zeek_Spicy;
 void EndpointState::debug(const std::string& msg) { spicy::zeek::rt::debug(_cookie, msg); }
 
 static auto create_endpoint(bool is_orig, ::zeek::analyzer::Analyzer* analyzer, spicy::rt::driver::ParsingType type) {
-    cookie::ProtocolAnalyzer cookie{.analyzer = analyzer,
-                                    .is_orig = is_orig,
-                                    .fstate_orig = cookie::FileStateStack(hilti::rt::fmt("%x.orig", analyzer->GetID())),
-                                    .fstate_resp =
-                                        cookie::FileStateStack(hilti::rt::fmt("%x.resp", analyzer->GetID()))};
+    cookie::ProtocolAnalyzer cookie{.analyzer = analyzer, .is_orig = is_orig};
 
     // Cannot get parser here yet, analyzer may not have been fully set up.
-    return EndpointState(cookie, type);
+    return EndpointState(std::move(cookie), type);
 }
 
 ProtocolAnalyzer::ProtocolAnalyzer(::zeek::analyzer::Analyzer* analyzer, spicy::rt::driver::ParsingType type)
-    : _originator(create_endpoint(true, analyzer, type)), _responder(create_endpoint(false, analyzer, type)) {}
+    : _originator(create_endpoint(true, analyzer, type)),
+      _responder(create_endpoint(false, analyzer, type)),
+      _type(type) {}
 
 ProtocolAnalyzer::~ProtocolAnalyzer() {}
 
@@ -45,7 +51,31 @@ void ProtocolAnalyzer::Process(bool is_orig, int len, const u_char* data) {
     if ( endp->cookie().analyzer->Skipping() )
         return;
 
+    auto& stats = OurPlugin->statisticsForProtocolAnalyzer(endp->cookie().analyzer->GetAnalyzerTag());
+    ++stats.chunks;
+
+    if ( data )
+        stats.bytes += len;
+
+    // Input held back by the prefilters, which gets parsed in place of the
+    // current chunk once they match. It has been counted already as it came in.
+    std::string held;
+
     if ( ! endp->hasParser() && ! endp->isSkipping() ) {
+        if ( ! endp->prefilterPassed() ) {
+            if ( ! checkPrefilters(endp, is_orig, len, data) )
+                return;
+
+            if ( _type == spicy::rt::driver::ParsingType::Stream ) {
+                held = endp->takePrefilterInput();
+
+                if ( ! held.empty() ) {
+                    data = reinterpret_cast<const u_char*>(held.data());
+                    len = static_cast<int>(held.size());
+                }
+            }
+        }
+
         auto parser = OurPlugin->parserForProtocolAnalyzer(endp->cookie().analyzer->GetAnalyzerTag(), is_orig);
         if ( parser ) {
             if ( ! _context )
@@ -56,44 +86,201 @@ void ProtocolAnalyzer::Process(bool is_orig, int len, const u_char* data) {
         else {
             STATE_DEBUG_MSG(is_orig, "no unit specified for parsing");
             endp->skipRemaining();
-            return;
         }
     }
 
+    const auto& max_buffered_bytes = ::zeek::BifConst::Spicy::max_buffered_bytes;
+    const auto& max_total_pending_bytes = ::zeek::BifConst::Spicy::max_total_pending_bytes;
+
+    // Track pending input if a limit needs it; the parser resets the count
+    // whenever it calls back into Zeek.
+    if ( rt::detail::track_progress && data && ! endp->isSkipping() )
+        endp->cookie().buffered += len;
+
+    if ( endp->isSkipping() ) {
+        // Nothing left to parse on this side, so don't bother passing the
+        // input on; just account for it.
+        if ( data )
+            stats.bytes_skipped += len;
+
+        return;
+    }
+
+    StatisticsTimer timer(::zeek::BifConst::Spicy::stats_timing ? &stats : nullptr);
+
     try {
         hilti::rt::context::CookieSetter _(&endp->cookie());
+        BudgetedAnalyzer::Active active(this);
         endp->process(len, reinterpret_cast<const char*>(data));
+
+        // A stream-based unit that's done won't look at any further input.
+        if ( _type == spicy::rt::driver::ParsingType::Stream && endp->isFinished() && ! endp->isSkipping() ) {
+            STATE_DEBUG_MSG(is_orig, "parsing finished, releasing state");
+            releaseState(endp);
+        }
     } catch ( const spicy::rt::ParseError& e ) {
         STATE_DEBUG_MSG(is_orig, hilti::rt::fmt("parse error, triggering analyzer violation: %s", e.what()));
+        ++stats.parse_errors;
         auto tag = OurPlugin->tagForProtocolAnalyzer(endp->cookie().analyzer->GetAnalyzerTag());
         spicy::zeek::compat::Analyzer_AnalyzerViolation(endp->cookie().analyzer, e.what(), nullptr, 0, tag);
-        originator().skipRemaining();
-        responder().skipRemaining();
+        releaseState(&_originator);
+        releaseState(&_responder);
         endp->cookie().analyzer->SetSkip(true);
     } catch ( const hilti::rt::Exception& e ) {
         reporter::analyzerError(endp->cookie().analyzer, e.description(),
                                 e.location()); // this sets Zeek to skip sending any further input
+        releaseState(&_originator);
+        releaseState(&_responder);
+    }
+
+    // Check the limit only now that the parser has seen the input, so that
+    // a chunk that it makes progress on doesn't count against it.
+    if ( max_buffered_bytes && endp->cookie().buffered > max_buffered_bytes && ! endp->isSkipping() ) {
+        auto buffered = endp->cookie().buffered;
+        STATE_DEBUG_MSG(is_orig, hilti::rt::fmt("%" PRIu64 " bytes buffered without progress, skipping further input",
+                                                buffered));
+        endp->cookie().analyzer->Weird("spicy_max_buffered_bytes_exceeded",
+                                       hilti::rt::fmt("%" PRIu64 " bytes", buffered).c_str());
+        releaseState(endp);
+    }
+
+    if ( max_total_pending_bytes ) {
+        auto& budget = OurPlugin->pendingInputBudget();
+        budget.charge(this, _originator.cookie().buffered + _responder.cookie().buffered);
+        budget.enforce(max_total_pending_bytes);
+    }
+}
+
+void ProtocolAnalyzer::evictFromBudget() {
+    auto* analyzer = _originator.cookie().analyzer;
+    auto buffered = _originator.cookie().buffered + _responder.cookie().buffered;
+
+    STATE_DEBUG_MSG(true, hilti::rt::fmt("evicted with %" PRIu64 " bytes pending, skipping all further input",
+                                         buffered));
+    analyzer->Weird("spicy_max_total_pending_bytes_exceeded", hilti::rt::fmt("%" PRIu64 " bytes", buffered).c_str());
+    releaseState(&_originator);
+    releaseState(&_responder);
+    analyzer->SetSkip(true);
+}
+
+void ProtocolAnalyzer::releaseState(EndpointState* endp) {
+    // Resetting drops the unit instance, its input stream, and any suspended
+    // fiber. Clearing the parser drops the endpoint's reference to the
+    // shared unit context. Skipping keeps the endpoint from starting over.
+    endp->reset();
+    endp->setParser(nullptr);
+    endp->skipRemaining();
+    endp->cookie().buffered = 0;
+
+    if ( _originator.isSkipping() && _responder.isSkipping() ) {
+        _context.reset();
+        OurPlugin->pendingInputBudget().remove(this);
+    }
+}
+
+bool ProtocolAnalyzer::checkPrefilters(EndpointState* endp, bool is_orig, int len, const u_char* data) {
+    const auto& prefilters =
+        OurPlugin->prefiltersForProtocolAnalyzer(endp->cookie().analyzer->GetAnalyzerTag(), is_orig);
+
+    if ( prefilters.empty() ) {
+        endp->setPrefilterPassed();
+        return true;
+    }
+
+    // For stream parsing, we may need to collect input across chunks until
+    // we have enough to decide.
+    std::string_view chunk;
+
+    if ( data ) {
+        if ( _type == spicy::rt::driver::ParsingType::Stream ) {
+            auto& input = endp->prefilterInput();
+            input.append(reinterpret_cast<const char*>(data), len);
+            chunk = input;
+        }
+        else
+            chunk = std::string_view(reinterpret_cast<const char*>(data), len);
+    }
+
+    bool match = false;
+    bool need_more = false;
+
+    for ( const auto& p : prefilters ) {
+        auto n = std::min(p.size(), chunk.size());
+        if ( memcmp(p.data(), chunk.data(), n) != 0 )
+            continue;
+
+        if ( n == p.size() ) {
+            match = true;
+            break;
+        }
+
+        need_more = true;
+    }
+
+    if ( match ) {
+        STATE_DEBUG_MSG(is_orig, "input matches prefilter");
+
+        endp->setPrefilterPassed();
+        return true;
     }
+
+    if ( need_more && data && _type == spicy::rt::driver::ParsingType::Stream )
+        return false;
+
+    // This side isn't our protocol. A gap ends up here as well, as we can't
+    // tell what was missing.
+    if ( data )
+        STATE_DEBUG_MSG(is_orig, "input does not match any prefilter, skipping this side");
+    else
+        STATE_DEBUG_MSG(is_orig, "gap before prefilters could decide, skipping this side");
+
+    // Everything held back counts as skipped now, including the current chunk.
+    auto discarded = endp->takePrefilterInput();
+    auto& stats = OurPlugin->statisticsForProtocolAnalyzer(endp->cookie().analyzer->GetAnalyzerTag());
+
+    if ( _type == spicy::rt::driver::ParsingType::Stream )
+        stats.bytes_skipped += discarded.size();
+    else if ( data )
+        stats.bytes_skipped += len;
+
+    releaseState(endp);
+
+    // Unless the other side has failed its prefilters as well, it may still
+    // turn out to be our protocol.
+    auto* other = is_orig ? &_responder : &_originator;
+    if ( ! (other->isSkipping() && ! other->prefilterPassed()) )
+        return false;
+
+    // Neither side is our protocol, so stop looking at the connection
+    // without having ever instantiated a parser.
+    STATE_DEBUG_MSG(is_orig, "neither side matches prefilters, skipping all further processing");
+    endp->cookie().analyzer->SetSkip(true);
+    return false;
 }
 
 void ProtocolAnalyzer::Finish(bool is_orig) {
     auto* endp = is_orig ? &_originator : &_responder;
 
-    if ( endp->cookie().analyzer->Skipping() )
+    if ( endp->cookie().analyzer->Skipping() || endp->isSkipping() )
         return;
 
+    auto& stats = OurPlugin->statisticsForProtocolAnalyzer(endp->cookie().analyzer->GetAnalyzerTag());
+    StatisticsTimer timer(::zeek::BifConst::Spicy::stats_timing ? &stats : nullptr);
+
     try {
         hilti::rt::context::CookieSetter _(&endp->cookie());
         endp->finish();
     } catch ( const spicy::rt::ParseError& e ) {
         STATE_DEBUG_MSG(is_orig, hilti::rt::fmt("parse error, triggering analyzer violation: %s", e.what()));
+        ++stats.parse_errors;
         auto tag = OurPlugin->tagForProtocolAnalyzer(endp->cookie().analyzer->GetAnalyzerTag());
         spicy::zeek::compat::Analyzer_AnalyzerViolation(endp->cookie().analyzer, e.what(), nullptr, 0, tag);
-        endp->skipRemaining();
     } catch ( const hilti::rt::Exception& e ) {
         reporter::analyzerError(endp->cookie().analyzer, e.description(),
                                 e.location()); // this sets Zeek to skip sending any further input
     }
+
+    releaseState(endp);
 }
 
 cookie::ProtocolAnalyzer& ProtocolAnalyzer::cookie(bool is_orig) {
@@ -125,6 +312,8 @@ TCP_Analyzer::~TCP_Analyzer() {}
 void TCP_Analyzer::Init() {
     ::zeek::analyzer::tcp::TCP_ApplicationAnalyzer::Init();
     ProtocolAnalyzer::Init();
+
+    _coalesce_bytes = OurPlugin->coalesceBytesForProtocolAnalyzer(GetAnalyzerTag());
 }
 
 void TCP_Analyzer::Done() {
@@ -138,13 +327,49 @@ void TCP_Analyzer::Done() {
 void TCP_Analyzer::DeliverStream(int len, const u_char* data, bool is_orig) {
     ::zeek::analyzer::tcp::TCP_ApplicationAnalyzer::DeliverStream(len, data, is_orig);
 
+    if ( ! _coalesce_bytes || Skipping() || (is_orig ? originator() : responder()).isSkipping() ) {
+        deliver(is_orig, len, data);
+        return;
+    }
+
+    // Maintain the order of input across the two sides.
+    flushCoalesced(! is_orig);
+
+    auto& coalesced = is_orig ? _coalesced_orig : _coalesced_resp;
+
+    if ( coalesced.size() + len < _coalesce_bytes ) {
+        coalesced.append(reinterpret_cast<const char*>(data), len);
+
+        if ( ! _coalesce_timer ) {
+            // Zeek has no timer type for plugin analyzers, and the type
+            // only labels timers in Zeek's statistics. We use the one that
+            // Zeek's TCP analyzer uses for its own per-connection timers, as
+            // ours too is tied to the TCP connection's lifetime.
+            AddTimer(static_cast<::zeek::analyzer::analyzer_timer_func>(&TCP_Analyzer::coalesceTimer),
+                     ::zeek::run_state::network_time + ::zeek::BifConst::Spicy::tcp_coalesce_delay, false,
+                     ::zeek::detail::TIMER_TCP_EXPIRE);
+            _coalesce_timer = true;
+        }
+
+        return;
+    }
+
+    if ( coalesced.empty() ) {
+        deliver(is_orig, len, data);
+        return;
+    }
+
+    coalesced.append(reinterpret_cast<const char*>(data), len);
+    flushCoalesced(is_orig);
+}
+
+void TCP_Analyzer::deliver(bool is_orig, int len, const u_char* data) {
     Process(is_orig, len, data);
 
-    if ( originator().isFinished() && responder().isFinished() &&
-         (! originator().isSkipping() || ! responder().isSkipping()) ) {
+    if ( originator().isFinished() && responder().isFinished() && ! Skipping() ) {
         STATE_DEBUG_MSG(is_orig, "both endpoints finished, skipping all further TCP processing");
-        originator().skipRemaining();
-        responder().skipRemaining();
+        releaseState(&originator());
+        releaseState(&responder());
 
         if ( is_orig ) // doesn't really matter which endpoint here.
             originator().cookie().analyzer->SetSkip(true);
@@ -153,15 +378,37 @@ void TCP_Analyzer::DeliverStream(int len, const u_char* data, bool is_orig) {
     }
 }
 
+void TCP_Analyzer::flushCoalesced(bool is_orig) {
+    auto& coalesced = is_orig ? _coalesced_orig : _coalesced_resp;
+
+    if ( coalesced.empty() )
+        return;
+
+    deliver(is_orig, static_cast<int>(coalesced.size()), reinterpret_cast<const u_char*>(coalesced.data()));
+    coalesced.clear();
+}
+
+void TCP_Analyzer::coalesceTimer(double t) {
+    _coalesce_timer = false;
+
+    // Only one side can have input pending at any time.
+    flushCoalesced(true);
+    flushCoalesced(false);
+}
+
 void TCP_Analyzer::Undelivered(uint64_t seq, int len, bool is_orig) {
     ::zeek::analyzer::tcp::TCP_ApplicationAnalyzer::Undelivered(seq, len, is_orig);
 
+    flushCoalesced(! is_orig);
+    flushCoalesced(is_orig);
     Process(is_orig, len, nullptr);
 }
 
 void TCP_Analyzer::EndOfData(bool is_orig) {
     ::zeek::analyzer::tcp::TCP_ApplicationAnalyzer::EndOfData(is_orig);
 
+    flushCoalesced(is_orig);
+
     if ( TCP() && TCP()->IsPartial() ) {
         STATE_DEBUG_MSG(is_orig, "skipping end-of-data delivery on partial TCP connection");
         return;
@@ -173,10 +420,12 @@ void TCP_Analyzer::EndOfData(bool is_orig) {
 void TCP_Analyzer::FlipRoles() {
     ::zeek::analyzer::tcp::TCP_ApplicationAnalyzer::FlipRoles();
     ProtocolAnalyzer::FlipRoles();
+    std::swap(_coalesced_orig, _coalesced_resp);
 }
 
 void TCP_Analyzer::EndpointEOF(bool is_orig) {
     ::zeek::analyzer::tcp::TCP_ApplicationAnalyzer::EndpointEOF(is_orig);
+    flushCoalesced(is_orig);
     Finish(is_orig);
 }
 
@@ -19,8 +19,18 @@ using namespace plugin::Zeek_Spicy;
 void rt::register_protocol_analyzer(const std::string& name, hilti::rt::Protocol proto,
                                     const hilti::rt::Vector<hilti::rt::Port>& ports, const std::string& parser_orig,
                                     const std::string& parser_resp, const std::string& replaces,
+                                    const hilti::rt::Vector<hilti::rt::Bytes>& prefilters_orig,
+                                    const hilti::rt::Vector<hilti::rt::Bytes>& prefilters_resp,
                                     const std::string& linker_scope) {
-    OurPlugin->registerProtocolAnalyzer(name, proto, ports, parser_orig, parser_resp, replaces, linker_scope);
+    OurPlugin->registerProtocolAnalyzer(name, proto, ports, parser_orig, parser_resp, replaces, prefilters_orig,
+                                        prefilters_resp, linker_scope);
+}
+
+void rt::register_protocol_analyzer(const std::string& name, hilti::rt::Protocol proto,
+                                    const hilti::rt::Vector<hilti::rt::Port>& ports, const std::string& parser_orig,
+                                    const std::string& parser_resp, const std::string& replaces,
+                                    const std::string& linker_scope) {
+    register_protocol_analyzer(name, proto, ports, parser_orig, parser_resp, replaces, {}, {}, linker_scope);
 }
 
 void rt::register_file_analyzer(const std::string& name, const hilti::rt::Vector<std::string>& mime_types,
@@ -51,41 +61,55 @@ void rt::install_handler(const std::string& name) { OurPlugin->registerEvent(nam
     return handler;
 }
 
-void rt::raise_event(const ::zeek::EventHandlerPtr& handler, const hilti::rt::Vector<::zeek::ValPtr>& args,
-                     const std::string& location) {
-    // Caller must have checked already that there's a handler availale.
+// Returns the statistics of the analyzer that a cookie belongs to.
+static rt::AnalyzerStatistics& analyzer_statistics(const rt::Cookie& cookie) {
+    if ( const auto c = std::get_if<rt::cookie::ProtocolAnalyzer>(&cookie) )
+        return OurPlugin->statisticsForProtocolAnalyzer(c->analyzer->GetAnalyzerTag());
+    else if ( const auto f = std::get_if<rt::cookie::FileAnalyzer>(&cookie) )
+        return OurPlugin->statisticsForFileAnalyzer(f->analyzer->Tag());
+    else
+        return OurPlugin->statisticsForPacketAnalyzer(
+            std::get<rt::cookie::PacketAnalyzer>(cookie).analyzer->GetAnalyzerTag());
+}
+
+rt::EventArgTypes rt::event_arg_types(const ::zeek::EventHandlerPtr& handler) {
     assert(handler);
+    return const_cast<::zeek::EventHandlerPtr&>(handler)->GetType()->ParamList()->GetTypes();
+}
 
-    const auto zeek_args = const_cast<::zeek::EventHandlerPtr&>(handler)->GetType()->ParamList()->GetTypes();
-    if ( args.size() != static_cast<uint64_t>(zeek_args.size()) )
-        throw TypeMismatch(hilti::rt::fmt("expected %" PRIu64 " parameters, but got %zu",
-                                          static_cast<uint64_t>(zeek_args.size()), args.size()),
+const ::zeek::TypePtr& rt::event_arg_type(const EventArgTypes& types, const hilti::rt::integer::safe<uint64_t>& idx,
+                                          const std::string& location) {
+    if ( idx >= static_cast<uint64_t>(types.size()) )
+        throw TypeMismatch(hilti::rt::fmt("more parameters given than the %" PRIu64 " that the Zeek event expects",
+                                          static_cast<uint64_t>(types.size())),
                            location);
 
-    ::zeek::Args vl = ::zeek::Args();
-    for ( const auto& v : args ) {
-        if ( v )
-            vl.emplace_back(v);
-        else
-            // Shouldn't happen here, but we have to_vals() that
-            // (legitimately) return null in certain contexts.
-            throw InvalidValue("null value encountered after conversion", location);
-    }
+    return types[idx];
+}
+
+void rt::event_arg_push(::zeek::Args& args, ::zeek::ValPtr v, const std::string& location) {
+    if ( ! v )
+        // Shouldn't happen here, but we have to_vals() that
+        // (legitimately) return null in certain contexts.
+        throw InvalidValue("null value encountered after conversion", location);
 
-    ::zeek::event_mgr.Enqueue(handler, vl);
+    args.emplace_back(std::move(v));
 }
 
-::zeek::TypePtr rt::event_arg_type(const ::zeek::EventHandlerPtr& handler,
-                                   const hilti::rt::integer::safe<uint64_t>& idx, const std::string& location) {
+void rt::raise_event(const ::zeek::EventHandlerPtr& handler, ::zeek::Args args, const std::string& location) {
+    // Caller must have checked already that there's a handler availale.
     assert(handler);
 
-    const auto zeek_args = const_cast<::zeek::EventHandlerPtr&>(handler)->GetType()->ParamList()->GetTypes();
-    if ( idx >= static_cast<uint64_t>(zeek_args.size()) )
-        throw TypeMismatch(hilti::rt::fmt("more parameters given than the %" PRIu64 " that the Zeek event expects",
-                                          static_cast<uint64_t>(zeek_args.size())),
+    const auto& zeek_args = const_cast<::zeek::EventHandlerPtr&>(handler)->GetType()->ParamList()->GetTypes();
+    if ( args.size() != zeek_args.size() )
+        throw TypeMismatch(hilti::rt::fmt("expected %" PRIu64 " parameters, but got %zu",
+                                          static_cast<uint64_t>(zeek_args.size()), args.size()),
                            location);
 
-    return zeek_args[idx];
+    if ( auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie()) )
+        ++analyzer_statistics(*cookie).events;
+
+    ::zeek::event_mgr.Enqueue(handler, std::move(args));
 }
 
 ::zeek::ValPtr rt::current_conn(const std::string& location) {
@@ -108,6 +132,22 @@ void rt::raise_event(const ::zeek::EventHandlerPtr& handler, const hilti::rt::Ve
         throw ValueUnavailable("$is_orig not available", location);
 }
 
+bool rt::detail::track_progress = false;
+
+void rt::note_progress() {
+    if ( ! detail::track_progress )
+        return;
+
+    auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
+    if ( ! cookie )
+        return;
+
+    if ( auto x = std::get_if<cookie::ProtocolAnalyzer>(cookie) )
+        x->buffered = 0;
+    else if ( auto x = std::get_if<cookie::FileAnalyzer>(cookie) )
+        x->buffered = 0;
+}
+
 void rt::debug(const std::string& msg) {
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     assert(cookie);
@@ -246,6 +286,8 @@ hilti::rt::integer::safe<uint64_t> rt::number_packets() {
 }
 
 void rt::confirm_protocol() {
+    note_progress();
+
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     assert(cookie);
 
@@ -286,6 +328,8 @@ void rt::weird(const std::string& id, const std::string& addl) {
 }
 
 void rt::protocol_begin(const std::optional<std::string>& analyzer) {
+    note_progress();
+
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     assert(cookie);
 
@@ -299,9 +343,11 @@ void rt::protocol_begin(const std::optional<std::string>& analyzer) {
             // analyzer. To make that work, we'll create a fake TCP analyzer,
             // just so that they have something to access. It won't
             // semantically have any "TCP" to analyze obviously.
-            c->fake_tcp = std::make_shared<::zeek::packet_analysis::TCP::TCPSessionAdapter>(c->analyzer->Conn());
-            static_cast<::zeek::analyzer::Analyzer*>(c->fake_tcp.get())
-                ->Done(); // will never see packets; cast to get around protected inheritance
+            if ( ! c->fake_tcp ) {
+                c->fake_tcp = std::make_unique<::zeek::packet_analysis::TCP::TCPSessionAdapter>(c->analyzer->Conn());
+                static_cast<::zeek::analyzer::Analyzer*>(c->fake_tcp.get())
+                    ->Done(); // will never see packets; cast to get around protected inheritance
+            }
         }
 
         auto child = ::zeek::analyzer_mgr->InstantiateAnalyzer(analyzer->c_str(), c->analyzer->Conn());
@@ -340,6 +386,8 @@ void rt::protocol_begin(const std::optional<std::string>& analyzer) {
 }
 
 void rt::protocol_data_in(const hilti::rt::Bool& is_orig, const hilti::rt::Bytes& data) {
+    note_progress();
+
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     assert(cookie);
 
@@ -352,6 +400,8 @@ void rt::protocol_data_in(const hilti::rt::Bool& is_orig, const hilti::rt::Bytes
 
 void rt::protocol_gap(const hilti::rt::Bool& is_orig, const hilti::rt::integer::safe<uint64_t>& offset,
                       const hilti::rt::integer::safe<uint64_t>& len) {
+    note_progress();
+
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     assert(cookie);
 
@@ -363,6 +413,8 @@ void rt::protocol_gap(const hilti::rt::Bool& is_orig, const hilti::rt::integer::
 }
 
 void rt::protocol_end() {
+    note_progress();
+
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     assert(cookie);
 
@@ -378,10 +430,20 @@ void rt::protocol_end() {
 }
 
 inline rt::cookie::FileStateStack* _file_state_stack(rt::Cookie* cookie) {
-    if ( auto c = std::get_if<rt::cookie::ProtocolAnalyzer>(cookie) )
-        return c->is_orig ? &c->fstate_orig : &c->fstate_resp;
-    else if ( auto f = std::get_if<rt::cookie::FileAnalyzer>(cookie) )
-        return &f->fstate;
+    // Most analyzers never pass data to file analysis, so stacks get created only once needed.
+    if ( auto c = std::get_if<rt::cookie::ProtocolAnalyzer>(cookie) ) {
+        if ( ! c->fstate )
+            c->fstate = std::make_unique<rt::cookie::FileStateStack>(
+                hilti::rt::fmt("%x.%s", c->analyzer->GetID(), (c->is_orig ? "orig" : "resp")));
+
+        return c->fstate.get();
+    }
+    else if ( auto f = std::get_if<rt::cookie::FileAnalyzer>(cookie) ) {
+        if ( ! f->fstate )
+            f->fstate = std::make_unique<rt::cookie::FileStateStack>(f->analyzer->GetFile()->GetID());
+
+        return f->fstate.get();
+    }
     else
         throw rt::ValueUnavailable("no current connection or file available");
 }
@@ -430,6 +492,8 @@ void rt::cookie::FileStateStack::remove(const std::string& fid) {
 
 static void _data_in(const char* data, uint64_t len, std::optional<uint64_t> offset,
                      const std::optional<std::string>& fid) {
+    rt::note_progress();
+
     auto cookie = static_cast<rt::Cookie*>(hilti::rt::context::cookie());
     auto* fstate = _file_state(cookie, fid);
     auto data_ = reinterpret_cast<const unsigned char*>(data);
@@ -463,6 +527,20 @@ void rt::terminate_session() {
         throw spicy::zeek::rt::ValueUnavailable("terminate_session() not available in the curent context");
 }
 
+void rt::skip_input() {
+    auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
+    assert(cookie);
+
+    if ( auto c = std::get_if<cookie::ProtocolAnalyzer>(cookie) ) {
+        ::spicy::zeek::compat::Connection_SetSkip(c->analyzer->Conn());
+
+        // Our own analyzer still gets to finish otherwise once the session ends.
+        c->analyzer->SetSkip(true);
+    }
+    else
+        throw spicy::zeek::rt::ValueUnavailable("skip_input() not available in the curent context");
+}
+
 std::string rt::fuid() {
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     assert(cookie);
@@ -476,6 +554,8 @@ std::string rt::fuid() {
 }
 
 std::string rt::file_begin(const std::optional<std::string>& mime_type) {
+    note_progress();
+
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     auto* fstate = _file_state_stack(cookie)->push();
     fstate->mime_type = mime_type;
@@ -513,6 +593,8 @@ std::string rt::file_begin(const std::optional<std::string>& mime_type) {
 }
 
 void rt::file_set_size(const hilti::rt::integer::safe<uint64_t>& size, const std::optional<std::string>& fid) {
+    note_progress();
+
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     auto* fstate = _file_state(cookie, fid);
 
@@ -535,6 +617,8 @@ void rt::file_data_in_at_offset(const hilti::rt::Bytes& data, const hilti::rt::i
 
 void rt::file_gap(const hilti::rt::integer::safe<uint64_t>& offset, const hilti::rt::integer::safe<uint64_t>& len,
                   const std::optional<std::string>& fid) {
+    note_progress();
+
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     auto* fstate = _file_state(cookie, fid);
 
@@ -547,6 +631,8 @@ void rt::file_gap(const hilti::rt::integer::safe<uint64_t>& offset, const hilti:
 }
 
 void rt::file_end(const std::optional<std::string>& fid) {
+    note_progress();
+
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     auto* fstate = _file_state(cookie, fid);
 